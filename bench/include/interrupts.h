@@ -0,0 +1,11 @@
+//host stub for the bench harnesses, user mode can't cli so these do nothing
+#pragma once
+#include <stdint.h>
+
+static inline uint32_t irq_save(void){
+    return 0;
+}
+
+static inline void irq_restore(uint32_t eflags){
+    (void)eflags;
+}
@@ -0,0 +1,7 @@
+//host stub for the bench harnesses, only what mm/ needs to compile
+#pragma once
+#include <stdint.h>
+
+#define KERNEL_VBASE 0xC0000000
+#define PHYS_TO_VIRT(p) ((void*)((uintptr_t)(p) + KERNEL_VBASE))
+#define VIRT_TO_PHYS(v) ((void*)((uintptr_t)(v) - KERNEL_VBASE))
@@ -0,0 +1,21 @@
+//host stub for the bench harnesses, only what mm/ needs to compile
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct{
+    uintptr_t start;
+    uintptr_t end;
+    size_t max_size;
+    bool is_supervisor;
+    bool is_readonly;
+    void* state;
+} heap_t;
+
+void kheap_init(heap_t *heap, void *start, size_t size, size_t max_size, bool is_supervisor, bool is_readonly);
+void* kmalloc(heap_t *heap, size_t size);
+void kfree(heap_t *heap, void *ptr);
+void* krealloc(heap_t *heap, void *ptr, size_t new_size);
+uint32_t kheap_shrink(heap_t *heap, uint32_t wanted);
+heap_t* get_kernel_heap(void);
@@ -0,0 +1,31 @@
+//host stub for the bench harnesses, only what mm/ needs to compile
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define _KMM_BLOCK_SIZE 4096
+#define _KMM_BLOCK_ALIGNMENT 4096
+#define MEM_SIZE_LOC 0x1000
+#define MEM_MAP_ENTRY_COUNT_LOC 0x2000
+#define MEM_MAP_LOC 0x2004
+
+typedef struct{
+    uint32_t memLow;
+    uint32_t memHigh;
+} e801_memsize_t;
+
+typedef struct{
+    uint32_t baseLow;
+    uint32_t baseHigh;
+    uint32_t lengthLow;
+    uint32_t lengthHigh;
+    uint32_t type;
+    uint32_t acpi;
+} e820_entry_t;
+
+typedef uint32_t (*kmm_shrink_fn)(uint32_t wanted);
+
+void* kmm_frame_alloc(void);
+void kmm_frame_free(void* phys_addr);
+bool kmm_register_shrinker(kmm_shrink_fn shrinker);
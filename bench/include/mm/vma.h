@@ -0,0 +1,18 @@
+//host stub for the bench harnesses, the heap range needs no reservation
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+
+#define VMA_HEAP 2
+
+typedef struct vm_space vm_space_t;
+
+static inline vm_space_t* vma_space_of(pagedir_t* pdir){
+    return NULL;
+}
+
+static inline bool vma_insert(vm_space_t* space, uintptr_t start, size_t size, uint32_t flags, uint32_t kind){
+    return true;
+}
@@ -0,0 +1,21 @@
+//host stub for the bench harnesses, the bench heap is not a supervisor one
+//so nothing goes to vmalloc
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+static inline void* vmalloc(size_t size){
+    return NULL;
+}
+
+static inline void vfree(void* addr){
+}
+
+static inline bool is_vmalloc_addr(const void* addr){
+    return false;
+}
+
+static inline size_t vmalloc_size(const void* addr){
+    return 0;
+}
@@ -0,0 +1,26 @@
+//host stub for the bench harnesses, the heap arena is plain host memory so
+//every page reads as resident
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define VMM_PAGE_SIZE 4096
+#define PTE_PRESENT 0x1
+#define PTE_WRITABLE 0x2
+#define PTE_USER 0x4
+#define PTE_NOEXEC 0x400
+
+typedef struct pagedir pagedir_t;
+
+static inline pagedir_t* vmm_get_kerneldir(void){
+    return NULL;
+}
+
+static inline uint32_t vmm_get_pfn(pagedir_t* pdir, void* virtual){
+    return 1;
+}
+
+static inline bool vmm_free_region(pagedir_t* pdir, void* virtual, size_t size){
+    return true;
+}
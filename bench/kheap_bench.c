@@ -0,0 +1,120 @@
+//host microbenchmark for the buddy allocator in mm/kheap.c
+//
+//build and run from the top of the tree:
+//    cc -O2 -Ibench/include -o kheap_bench bench/kheap_bench.c && ./kheap_bench
+//
+//KHEAP_SRC picks another allocator to compare against, e.g. the one that
+//walked the free lists before the per-order bitmaps went in:
+//    git show 38856ab^:mm/kheap.c > /tmp/kheap_old.c
+//    cc -O2 -Ibench/include -DKHEAP_SRC='"/tmp/kheap_old.c"' -o kheap_old bench/kheap_bench.c
+//
+//the allocator is compiled in as is over a malloc'd arena, only the headers
+//under bench/include are stubs, every page of the arena counts as resident
+//
+//each level first leaves holes free min-order blocks whose buddies stay
+//allocated, then runs the same alloc/free mix, kfree finds out whether a
+//buddy is free with one bitmap test, so the cost per pair should not grow
+//with the number of holes, a free list walk would grow linearly
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//kheap.c provides malloc, free and realloc over the kernel heap, keep them
+//away from the host's
+#define malloc kheap_malloc
+#define free kheap_free
+#define realloc kheap_realloc
+#ifndef KHEAP_SRC
+#define KHEAP_SRC "../mm/kheap.c"
+#endif
+#include <mm/kmm.h>
+#include KHEAP_SRC
+#undef malloc
+#undef free
+#undef realloc
+
+#define BENCH_ARENA (2u * 1024 * 1024)
+#define BENCH_LIVE 64             //allocations held at once by the mix
+#define BENCH_OPS 4000000         //kmalloc/kfree pairs per level
+
+static const uint32_t bench_holes[] = {0, 512, 2048, 8192};
+
+//kheap_init registers a shrinker for the kernel heap only
+bool kmm_register_shrinker(kmm_shrink_fn shrinker){
+    return true;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//xorshift, the same sequence on every run and level
+static uint32_t bench_rand(uint32_t* seed){
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+//ns per kmalloc/kfree pair after leaving holes free blocks of the smallest
+//order behind
+static double bench_level(void* arena, uint32_t holes){
+    heap_t heap;
+    kheap_init(&heap, arena, BENCH_ARENA, BENCH_ARENA, false, false);
+
+    //take pairs of buddies, then give back one of each, freeing as we go
+    //would hand the same hole straight back to the next kmalloc
+    void** blocks = calloc(holes ? 2 * holes : 1, sizeof(void*));
+    for(uint32_t i = 0; i < 2 * holes; i++){
+        blocks[i] = kmalloc(&heap, 1);
+        if(!blocks[i]){
+            printf("arena too small for %u holes\n", holes);
+            exit(1);
+        }
+    }
+    for(uint32_t i = 0; i < 2 * holes; i += 2){
+        kfree(&heap, blocks[i]);
+    }
+
+    //sizes from 1 byte to 4KB, smaller ones more often
+    void* live[BENCH_LIVE] = {0};
+    uint32_t seed = 0x2545F491;
+    double start = now();
+    for(uint32_t i = 0; i < BENCH_OPS; i++){
+        uint32_t slot = i % BENCH_LIVE;
+        kfree(&heap, live[slot]);
+        uint32_t r = bench_rand(&seed);
+        live[slot] = kmalloc(&heap, (r >> 8) % (32u << (r % 8)) + 1);
+        if(!live[slot]){
+            printf("out of memory with %u holes\n", holes);
+            exit(1);
+        }
+    }
+    double elapsed = now() - start;
+
+    for(uint32_t slot = 0; slot < BENCH_LIVE; slot++){
+        kfree(&heap, live[slot]);
+    }
+    for(uint32_t i = 1; i < 2 * holes; i += 2){
+        kfree(&heap, blocks[i]);
+    }
+    free(blocks);
+    return elapsed * 1e9 / BENCH_OPS;
+}
+
+int main(void){
+    void* arena = aligned_alloc(VMM_PAGE_SIZE, BENCH_ARENA);
+    double base = 0;
+    printf("%u kmalloc/kfree pairs per level, %u live\n", BENCH_OPS, BENCH_LIVE);
+    for(uint32_t i = 0; i < sizeof(bench_holes) / sizeof(bench_holes[0]); i++){
+        double ns = bench_level(arena, bench_holes[i]);
+        if(i == 0){
+            base = ns;
+        }
+        printf("%5u holes: %6.1f ns/pair  %.2fx\n", bench_holes[i], ns, ns / base);
+    }
+    free(arena);
+    return 0;
+}
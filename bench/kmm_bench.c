@@ -0,0 +1,128 @@
+//host microbenchmark for the frame allocator in mm/kmm.c
+//
+//build and run from the top of the tree:
+//    cc -O2 -Ibench/include -o kmm_bench bench/kmm_bench.c && ./kmm_bench
+//
+//the allocator is compiled in as is, only the headers under bench/include
+//are stubs, kmm_init itself reads the bios memory map and the boot page
+//directory so bench_init below does the same setup on malloc'd descriptors
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+#pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
+#include "../mm/kmm.c"
+
+#define BENCH_MEMORY (256u * 1024 * 1024)
+#define BENCH_ROUNDS 20
+#define BENCH_STRIDE 7            //every 7th frame is freed and taken again each round
+#define BENCH_PAIRS 10000000      //alloc and free back to back, the magazine fast path
+
+//kmm_init references these, the harness never calls it
+uint32_t kernel_start;
+uint32_t kernel_end;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//what kmm_init does for a single usable range from 1MB up to memory
+static void bench_init(uint32_t memory){
+    total_frames = memory / _KMM_BLOCK_SIZE;
+    lowmem_frames = (total_frames < LOWMEM_LIMIT / _KMM_BLOCK_SIZE) ? total_frames : LOWMEM_LIMIT / _KMM_BLOCK_SIZE;
+    bitmap_size = (total_frames + 31) / 32;
+    memory_bitmap = malloc(bitmap_size * sizeof(uint32_t));
+    pages = malloc(total_frames * sizeof(struct page));
+
+    for(uint32_t i = 0; i < bitmap_size; i++){
+        memory_bitmap[i] = 0xFFFFFFFF;
+    }
+    for(uint32_t i = 0; i < total_frames; i++){
+        pages[i].next = FRAME_NONE;
+        pages[i].prev = FRAME_NONE;
+        pages[i].refcount = 0;
+        pages[i].order = ORDER_NONE;
+        if(i < DMA_ZONE_LIMIT / _KMM_BLOCK_SIZE){
+            pages[i].flags = KMM_ZONE_DMA;
+        }
+        else{
+            pages[i].flags = (i < lowmem_frames) ? KMM_ZONE_NORMAL : KMM_ZONE_HIGHMEM;
+        }
+    }
+    used_frames = total_frames;
+    setup_region64(0x100000, memory - 0x100000, false);
+
+    uint32_t dma_end = DMA_ZONE_LIMIT / _KMM_BLOCK_SIZE;
+    if(dma_end > total_frames){
+        dma_end = total_frames;
+    }
+    zones[KMM_ZONE_DMA].start_frame = 0;
+    zones[KMM_ZONE_DMA].end_frame = dma_end;
+    zones[KMM_ZONE_NORMAL].start_frame = dma_end;
+    zones[KMM_ZONE_NORMAL].end_frame = lowmem_frames;
+    zones[KMM_ZONE_HIGHMEM].start_frame = lowmem_frames;
+    zones[KMM_ZONE_HIGHMEM].end_frame = total_frames;
+    for(uint32_t z = 0; z < KMM_ZONE_COUNT; z++){
+        for(uint32_t order = 0; order <= KMM_MAX_ORDER; order++){
+            zones[z].free_lists[order] = FRAME_NONE;
+            zones[z].free_blocks[order] = 0;
+        }
+    }
+    for(uint32_t frame = total_frames; frame-- > 0;){
+        if(!isframe_used(frame)){
+            buddy_insert(frame, 0);
+        }
+        else{
+            pages[frame].flags |= PAGE_RESERVED;
+        }
+    }
+}
+
+int main(void){
+    bench_init(BENCH_MEMORY);
+    void** frames = malloc(total_frames * sizeof(void*));
+
+    //take every frame there is
+    uint32_t count = 0;
+    double start = now();
+    while((frames[count] = kmm_frame_alloc()) != NULL){
+        count++;
+    }
+    double fill = now() - start;
+
+    //then punch holes all over memory and fill them again
+    uint64_t allocs = 0;
+    start = now();
+    for(uint32_t round = 0; round < BENCH_ROUNDS; round++){
+        for(uint32_t i = round % BENCH_STRIDE; i < count; i += BENCH_STRIDE){
+            kmm_frame_free(frames[i]);
+        }
+        for(uint32_t i = round % BENCH_STRIDE; i < count; i += BENCH_STRIDE){
+            frames[i] = kmm_frame_alloc();
+            if(!frames[i]){
+                printf("ran out of frames in round %u\n", round);
+                return 1;
+            }
+            allocs++;
+        }
+    }
+    double churn = now() - start;
+
+    for(uint32_t i = 0; i < count; i++){
+        kmm_frame_free(frames[i]);
+    }
+    start = now();
+    for(uint32_t i = 0; i < BENCH_PAIRS; i++){
+        kmm_frame_free(kmm_frame_alloc());
+    }
+    double pairs = now() - start;
+
+    printf("%u MB, %u frames handed out\n", BENCH_MEMORY >> 20, count);
+    printf("fill:   %.1fM allocs/sec\n", count / fill / 1e6);
+    printf("churn:  %.1fM allocs/sec (%u rounds, every %uth frame)\n", allocs / churn / 1e6, BENCH_ROUNDS, BENCH_STRIDE);
+    printf("pairs:  %.1fM alloc+free/sec\n", BENCH_PAIRS / pairs / 1e6);
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include <fs/hfs.h>
 #include <driver/block.h>
 #include <mm/kheap.h>
+#include <mm/slab.h>
+#include <mm/pagecache.h>
 
 #define LOG_MOD_NAME 	"HFS"
 #define LOG_MOD_ENABLE  1
@@ -31,6 +33,11 @@ static vnode_ops_t hfs_vnode_ops = {
 	.remove  = hfs_remove
 };
 
+//every open makes a vnode and a boxed inode number, close frees both
+static kmem_cache_t* vnode_cache = NULL;
+static kmem_cache_t* vfs_cache = NULL;
+static kmem_cache_t* inode_num_cache = NULL;
+
 fs_type_t hfs_fs_type = {
 	.fs_name = "hfs",
 	.vfs_ops = {
@@ -595,7 +602,24 @@ int hfs_format(const char* device){
     return 0;
 }
 
+static bool hfs_init_caches(void){
+    if(!vnode_cache){
+        vnode_cache = kmem_cache_create("hfs_vnode", sizeof(vnode), 0, NULL);
+    }
+    if(!vfs_cache){
+        vfs_cache = kmem_cache_create("hfs_vfs", sizeof(vfs), 0, NULL);
+    }
+    if(!inode_num_cache){
+        inode_num_cache = kmem_cache_create("hfs_inode_num", sizeof(uint32_t), 0, NULL);
+    }
+    return vnode_cache && vfs_cache && inode_num_cache;
+}
+
 vfs* hfs_mount(const char* device){
+    if(!hfs_init_caches()){
+        LOG_ERROR("failed to create object caches\n");
+        return NULL;
+    }
     block_device_t* dev = blkdev_get_by_name(device);
     if(!dev){
         LOG_ERROR("failed to get block device %s\n", device);
@@ -657,7 +681,7 @@ vfs* hfs_mount(const char* device){
     memcpy(hfs_data->inode_bitmap, ibmap_block.bitmap, BLOCK_SIZE);
     
     // create root vnode
-    vnode* root = malloc(sizeof(vnode));
+    vnode* root = kmem_cache_alloc(vnode_cache);
     if(!root){
         free(hfs_data->inode_bitmap);
         free(hfs_data->block_bitmap);
@@ -671,9 +695,9 @@ vfs* hfs_mount(const char* device){
     root->ops = &hfs_vnode_ops;
     root->flags = 0;
     
-    uint32_t* inode_num_ptr = malloc(sizeof(uint32_t));
+    uint32_t* inode_num_ptr = kmem_cache_alloc(inode_num_cache);
     if(!inode_num_ptr){
-        free(root);
+        kmem_cache_free(vnode_cache, root);
         free(hfs_data->inode_bitmap);
         free(hfs_data->block_bitmap);
         free(hfs_data);
@@ -684,10 +708,10 @@ vfs* hfs_mount(const char* device){
     root->data = inode_num_ptr;
     
     // make vfs object
-    vfs* filesystem = malloc(sizeof(vfs));
+    vfs* filesystem = kmem_cache_alloc(vfs_cache);
     if(!filesystem){
-        free(inode_num_ptr);
-        free(root);
+        kmem_cache_free(inode_num_cache, inode_num_ptr);
+        kmem_cache_free(vnode_cache, root);
         free(hfs_data->inode_bitmap);
         free(hfs_data->block_bitmap);
         free(hfs_data);
@@ -726,13 +750,13 @@ int32_t hfs_unmount(vfs* fsys){
     
     if(fsys->vroot){
         if(fsys->vroot->data){
-            free(fsys->vroot->data);
+            kmem_cache_free(inode_num_cache, fsys->vroot->data);
             fsys->vroot->data = NULL;
         }
-        free(fsys->vroot);
+        kmem_cache_free(vnode_cache, fsys->vroot);
         fsys->vroot = NULL;
     }
-    free(fsys);
+    kmem_cache_free(vfs_cache, fsys);
     LOG_DEBUG("unmounted HFS filesystem\n");
     return 0;
 }
@@ -926,7 +950,7 @@ vnode* hfs_open(vnode* root, const char* path, uint32_t flags){
         return NULL;
     }
     
-    vnode* node = malloc(sizeof(vnode));
+    vnode* node = kmem_cache_alloc(vnode_cache);
     if(!node){
         return NULL;
     }
@@ -946,9 +970,9 @@ vnode* hfs_open(vnode* root, const char* path, uint32_t flags){
     node->vfs_ptr = root->vfs_ptr;
     node->flags = flags;
     
-    uint32_t* inode_num_ptr = malloc(sizeof(uint32_t));
+    uint32_t* inode_num_ptr = kmem_cache_alloc(inode_num_cache);
     if(!inode_num_ptr){
-        free(node);
+        kmem_cache_free(vnode_cache, node);
         return NULL;
     }
     *inode_num_ptr = inode_num;
@@ -962,10 +986,10 @@ int32_t hfs_close(vnode* node){
         return -1;
     }
     if(node->data){
-        free(node->data);
+        kmem_cache_free(inode_num_cache, node->data);
         node->data = NULL;
     }
-    free(node);
+    kmem_cache_free(vnode_cache, node);
     return 0;
 }
 
@@ -1012,10 +1036,13 @@ int32_t hfs_read(vnode* node, uint32_t offset, uint32_t size, void* buf){
         }
         bytes_read += bytes_to_read;
     }
+    //pages mapped shared may hold stores the disk has not seen yet
+    pagecache_read(node->vfs_ptr, inode_num, offset, buffer, bytes_read);
     return (int32_t)bytes_read;
 }
 
-int32_t hfs_write(vnode* node, uint32_t offset, uint32_t size, void* buf){
+//straight to the disk, the page cache is left alone
+static int32_t hfs_write_blocks(vnode* node, uint32_t offset, uint32_t size, void* buf){
     if(!node || !buf || !node->data || !node->vfs_ptr || !node->vfs_ptr->fs_data){
         return -1;
     }
@@ -1084,6 +1111,76 @@ int32_t hfs_write(vnode* node, uint32_t offset, uint32_t size, void* buf){
     return (int32_t)bytes_written;
 }
 
+int32_t hfs_write(vnode* node, uint32_t offset, uint32_t size, void* buf){
+    int32_t written = hfs_write_blocks(node, offset, size, buf);
+    if(written > 0){
+        pagecache_write(node->vfs_ptr, *(uint32_t*)node->data, offset, buf, (uint32_t)written);
+    }
+    return written;
+}
+
+//inode behind an open vnode, the same for every open of the file
+int32_t hfs_file_id(vnode* node){
+    if(!node || !node->data || node->type != V_FILE){
+        return -1;
+    }
+    return (int32_t)*(uint32_t*)node->data;
+}
+
+//fill size bytes of a page cache page at offset, whole blocks are read
+//straight into it without the stack block, holes and the part past the
+//end of the file come back zeroed
+int32_t hfs_readpage(vfs* fsys, uint32_t inode_num, uint32_t offset, void* page, uint32_t size){
+    if(!fsys || !fsys->fs_data || !page || (size % BLOCK_SIZE) != 0 || (offset % BLOCK_SIZE) != 0){
+        return -1;
+    }
+    struct hfs_data* hfs = (struct hfs_data*)fsys->fs_data;
+    struct inode inode;
+    if(read_inode(hfs, inode_num, &inode) < 0){
+        return -1;
+    }
+    
+    uint8_t* buffer = (uint8_t*)page;
+    for(uint32_t done = 0; done < size; done += BLOCK_SIZE){
+        int32_t block_num = (offset + done < inode.i_size) ? get_block_for_offset(hfs, &inode, offset + done) : 0;
+        if(block_num <= 0){
+            memset(buffer + done, 0, BLOCK_SIZE);
+        }
+        else if(blkread(hfs->device, block_num, buffer + done) < 0){
+            return -1;
+        }
+    }
+    //tail of the last block
+    if(offset + size > inode.i_size && offset < inode.i_size){
+        memset(buffer + (inode.i_size - offset), 0, offset + size - inode.i_size);
+    }
+    return (int32_t)size;
+}
+
+//write a page cache page back, never past the end of the file
+int32_t hfs_writepage(vfs* fsys, uint32_t inode_num, uint32_t offset, void* page, uint32_t size){
+    if(!fsys || !fsys->fs_data || !page){
+        return -1;
+    }
+    struct inode inode;
+    if(read_inode((struct hfs_data*)fsys->fs_data, inode_num, &inode) < 0){
+        return -1;
+    }
+    if(offset >= inode.i_size){
+        return 0;
+    }
+    if(offset + size > inode.i_size){
+        size = inode.i_size - offset;
+    }
+    
+    vnode node;
+    memset(&node, 0, sizeof(vnode));
+    node.type = V_FILE;
+    node.vfs_ptr = fsys;
+    node.data = &inode_num;
+    return hfs_write_blocks(&node, offset, size, page);
+}
+
 int32_t hfs_readdir(vnode* node, uint32_t index, struct directory_entry* entry){
     if(!node || !node->data || !entry || !node->vfs_ptr || !node->vfs_ptr->fs_data){
         return -1;
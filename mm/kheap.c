@@ -1,16 +1,17 @@
 #include <mm/kheap.h>
+#include <mm/kmm.h>
 #include <mm/vmm.h>
+#include <mm/vma.h>
+#include <mm/vmalloc.h>
 #include <string.h>
 // #include <log.h>
 
 #define BUDDY_MIN_ORDER 5
 #define BUDDY_MAX_ORDER 20
-#define BUDDY_MAGIC 0xDEADBEEF
-
-typedef struct{
-    uint32_t size;
-    uint32_t magic;
-} alloc_block_hdr;
+#define KHEAP_PAGE_ORDER 12           //base alignment once the heap spans a page
+#define KHEAP_VMALLOC_THRESHOLD (64 * 1024)  //past this whole buddy blocks get too coarse
+#define KHEAP_GROW_ORDER 16           //64KB of the reserved range joins the free lists at a time
+#define KHEAP_SHRINK_ORDER 14         //free blocks from 16KB up give their frames back under pressure
 
 typedef struct _free_block_hdr{
     struct _free_block_hdr* next;
@@ -23,6 +24,12 @@ typedef struct{
     uint32_t min_order;
     uint32_t max_order;
     free_block_hdr* free_lists[BUDDY_MAX_ORDER + 1];
+    uint32_t* free_maps[BUDDY_MAX_ORDER + 1];  //bit per block of each order, set while it sits on a free list
+    uint8_t* block_orders;    //order of the allocation starting at each min block, 0 if none
+    uintptr_t grown;          //end of the part handed to the free lists so far
+    volatile uint32_t busy;   //free lists mid update, the shrinker keeps out
+    size_t resident_peak;
+    size_t released;          //bytes handed back to kmm over the heap's life
 } buddy_state_t;
 
 heap_t kernel_heap;
@@ -77,19 +84,187 @@ static free_block_hdr* list_pop(free_block_hdr** head){
     return node;
 }
 
-static void buddy_init(buddy_state_t* state, uintptr_t base, size_t size, uint32_t min_order, uint32_t max_order){
+//bytes of free bitmaps for blocks from min_order up to max_order
+static size_t free_maps_size(uint32_t min_order, uint32_t max_order){
+    size_t bytes = 0;
+    for(uint32_t order = min_order; order <= max_order; order++){
+        bytes += ((order_to_size(max_order - order) + 31) / 32) * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+static inline uint32_t free_map_bit(buddy_state_t* state, uint32_t order, uintptr_t block){
+    return (block - state->base) >> order;
+}
+
+static inline bool free_map_test(buddy_state_t* state, uint32_t order, uintptr_t block){
+    uint32_t bit = free_map_bit(state, order, block);
+    return (state->free_maps[order][bit / 32] & (1u << (bit % 32))) != 0;
+}
+
+static inline void free_map_set(buddy_state_t* state, uint32_t order, uintptr_t block, bool is_free){
+    uint32_t bit = free_map_bit(state, order, block);
+    if(is_free){
+        state->free_maps[order][bit / 32] |= 1u << (bit % 32);
+    }
+    else{
+        state->free_maps[order][bit / 32] &= ~(1u << (bit % 32));
+    }
+}
+
+//free list operations that keep the bitmaps in step
+static void free_block_push(buddy_state_t* state, uint32_t order, free_block_hdr* node){
+    list_push(&state->free_lists[order], node);
+    free_map_set(state, order, (uintptr_t)node, true);
+}
+
+static void free_block_remove(buddy_state_t* state, uint32_t order, free_block_hdr* node){
+    list_remove(&state->free_lists[order], node);
+    free_map_set(state, order, (uintptr_t)node, false);
+}
+
+static free_block_hdr* free_block_pop(buddy_state_t* state, uint32_t order){
+    free_block_hdr* node = list_pop(&state->free_lists[order]);
+    if(node){
+        free_map_set(state, order, (uintptr_t)node, false);
+    }
+    return node;
+}
+
+//one byte per min block the top block spans
+static inline size_t block_orders_size(uint32_t min_order, uint32_t max_order){
+    return order_to_size(max_order - min_order);
+}
+
+//order of the allocation starting at block, 0 for anything kmalloc did not
+//hand out, which also catches double frees
+static inline uint32_t block_order_of(buddy_state_t* state, uintptr_t block){
+    uintptr_t offset = block - state->base;
+    if(offset >= order_to_size(state->max_order) || (offset & (order_to_size(state->min_order) - 1))){
+        return 0;
+    }
+    return state->block_orders[offset >> state->min_order];
+}
+
+static inline void block_order_set(buddy_state_t* state, uintptr_t block, uint32_t order){
+    state->block_orders[(block - state->base) >> state->min_order] = (uint8_t)order;
+}
+
+//maps points at free_maps_size(min_order, max_order) bytes followed by
+//block_orders_size(min_order, max_order)
+static void buddy_init(buddy_state_t* state, uintptr_t base, size_t size, uint32_t min_order, uint32_t max_order, uint32_t* maps){
     state->base = base;
     state->size = size;
     state->min_order = min_order;
     state->max_order = max_order;
+    state->grown = base;
+    state->busy = 0;
+    state->resident_peak = 0;
+    state->released = 0;
     
     for(uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++){
         state->free_lists[i] = NULL;
+        state->free_maps[i] = NULL;
     }
-    free_block_hdr* initial_block = (free_block_hdr*)base;
-    initial_block->next = NULL;
-    initial_block->prev = NULL;
-    state->free_lists[max_order] = initial_block;
+    memset(maps, 0, free_maps_size(min_order, max_order));
+    for(uint32_t order = min_order; order <= max_order; order++){
+        state->free_maps[order] = maps;
+        maps += (order_to_size(max_order - order) + 31) / 32;
+    }
+    state->block_orders = (uint8_t*)maps;
+    memset(state->block_orders, 0, block_orders_size(min_order, max_order));
+}
+
+//block of exactly order, split down from the smallest larger one, 0 if none
+static uintptr_t buddy_alloc(buddy_state_t* state, uint32_t order){
+    //find first free
+    uint32_t current_order = order;
+    while(current_order <= state->max_order && !state->free_lists[current_order]){
+        current_order++;
+    }
+    if(current_order > state->max_order){
+        return 0;
+    }
+    
+    //split larger blocks to req order
+    while(current_order > order){
+        free_block_hdr* block = free_block_pop(state, current_order);
+        current_order--;
+        size_t half_size = order_to_size(current_order);
+        uintptr_t first_half = (uintptr_t)block;
+        uintptr_t second_half = first_half + half_size;
+        //add both halves to the smaller free list
+        free_block_push(state, current_order, (free_block_hdr*)first_half);
+        free_block_push(state, current_order, (free_block_hdr*)second_half);
+    }
+    return (uintptr_t)free_block_pop(state, order);
+}
+
+//give a block back, merging with free buddies as far as they go
+static void buddy_free(buddy_state_t* state, uintptr_t block_addr, uint32_t order){
+    size_t block_size = order_to_size(order);
+    while(order < state->max_order){
+        uintptr_t buddy_addr = get_buddy_addr(state->base, block_addr, block_size);
+        //check if buddy is free, a single bit instead of a list walk
+        if(!free_map_test(state, order, buddy_addr)){
+            break;
+        }
+        
+        //remove buddy from free list
+        free_block_remove(state, order, (free_block_hdr*)buddy_addr);
+        
+        //merge blocks
+        if(buddy_addr < block_addr){
+            block_addr = buddy_addr;
+        }
+        order++;
+        block_size *= 2;
+    }
+    
+    //insert merged into free
+    free_block_hdr* free_block = (free_block_hdr*)block_addr;
+    free_block->next = NULL;
+    free_block->prev = NULL;
+    free_block_push(state, order, free_block);
+}
+
+//hand the next chunk of the range to the free lists, it merges with free
+//neighbours like any freed block, false once the whole range is in
+static bool heap_grow(buddy_state_t* state){
+    uintptr_t top = state->base + order_to_size(state->max_order);
+    if(state->grown >= top){
+        return false;
+    }
+    uint32_t order = state->max_order < KHEAP_GROW_ORDER ? state->max_order : KHEAP_GROW_ORDER;
+    uintptr_t chunk = state->grown;
+    state->grown += order_to_size(order);
+    buddy_free(state, chunk, order);
+    return true;
+}
+
+//pages with a frame behind them in [start, end)
+static uint32_t count_resident(uintptr_t start, uintptr_t end){
+    pagedir_t* pdir = vmm_get_kerneldir();
+    uint32_t count = 0;
+    for(uintptr_t va = start; va < end; va += VMM_PAGE_SIZE){
+        if(vmm_get_pfn(pdir, (void*)va)){
+            count++;
+        }
+    }
+    return count;
+}
+
+//state and bitmaps included, the range past grown was never touched
+static size_t heap_resident(buddy_state_t* state){
+    size_t resident = count_resident((uintptr_t)state & ~(VMM_PAGE_SIZE - 1), state->grown) * VMM_PAGE_SIZE;
+    if(resident > state->resident_peak){
+        state->resident_peak = resident;
+    }
+    return resident;
+}
+
+static uint32_t kheap_shrink_kernel(uint32_t wanted){
+    return kheap_shrink(&kernel_heap, wanted);
 }
 
 void kheap_init(heap_t *heap, void *start, size_t size, size_t max_size, bool is_supervisor, bool is_readonly){
@@ -111,138 +286,142 @@ void kheap_init(heap_t *heap, void *start, size_t size, size_t max_size, bool is
     heap->is_supervisor = is_supervisor;
     heap->is_readonly = is_readonly;
     
-    //allocate buddy state at the start of the heap
-    buddy_state_t* state = (buddy_state_t*)aligned_start;
-    aligned_start += sizeof(buddy_state_t);
-    usable_size -= sizeof(buddy_state_t);
+    //reserve the virt mem region, pages are backed on first touch
+    pagedir_t* pdir = vmm_get_kerneldir();
+    uint32_t flags = PTE_PRESENT | PTE_WRITABLE | PTE_NOEXEC;
+    if(!is_supervisor){
+        flags |= PTE_USER;
+    }
+    if(!vma_insert(vma_space_of(pdir), heap->start, heap->max_size, flags, VMA_HEAP)){
+        // LOG_ERROR("Failed to reserve heap region at 0x%x", heap->start);
+        return;
+    }
     
-    //realign
-    aligned_start = (aligned_start + min_block_size - 1) & ~(min_block_size - 1);
+    //allocate buddy state at the start of the heap, free bitmaps right after
+    buddy_state_t* state = (buddy_state_t*)aligned_start;
+    uint32_t* maps = (uint32_t*)(aligned_start + sizeof(buddy_state_t));
+    uintptr_t heap_end = aligned_start + usable_size;
     
-    //calc max order
+    //calc max order, the bitmaps grow with it so shrink until both fit
     uint32_t max_order = log2_floor(usable_size);
     if(max_order > BUDDY_MAX_ORDER){
         max_order = BUDDY_MAX_ORDER;
     }
+    for(;;){
+        aligned_start = (uintptr_t)maps + free_maps_size(BUDDY_MIN_ORDER, max_order) + block_orders_size(BUDDY_MIN_ORDER, max_order);
+        //realign, page sized blocks then cover whole pages
+        size_t base_align = max_order >= KHEAP_PAGE_ORDER ? order_to_size(KHEAP_PAGE_ORDER) : min_block_size;
+        aligned_start = (aligned_start + base_align - 1) & ~(base_align - 1);
+        if(aligned_start + order_to_size(max_order) <= heap_end || max_order == BUDDY_MIN_ORDER){
+            break;
+        }
+        max_order--;
+    }
+    usable_size = heap_end - aligned_start;
     
-    //initialize buddy allocator
-    buddy_init(state, aligned_start, usable_size, BUDDY_MIN_ORDER, max_order);
+    //initialize buddy allocator, the range joins it chunk by chunk
+    state->busy = 1;
+    buddy_init(state, aligned_start, usable_size, BUDDY_MIN_ORDER, max_order, maps);
+    heap_grow(state);
+    state->busy = 0;
     heap->state = state;
-    
-    //map the virt mem region
-    pagedir_t* pdir = vmm_get_kerneldir();
-    uint32_t flags = PTE_PRESENT | PTE_WRITABLE;
-    if(!is_supervisor){
-        flags |= PTE_USER;
+    if(heap == &kernel_heap){
+        kmm_register_shrinker(kheap_shrink_kernel);
     }
-
-    if(!vmm_alloc_region(pdir, (void*)heap->start, heap->max_size, flags)){
-        // LOG_ERROR("Failed to map heap region at 0x%x", heap->start);
-        return;
-    }    
     // LOG_DEBUG("Heap initialized: start=0x%x, size=%u KB", aligned_start, usable_size / 1024);
 }
 
+//pages are backed on first touch and kheap_shrink takes frames back from
+//free blocks, so the memory may fault when used, kernel stacks and anything
+//else touched where a fault is fatal must not come from here (kstack_alloc)
 void* kmalloc(heap_t *heap, size_t size){
     if(!heap || size == 0){
         return NULL;
     }
+    //big buffers would eat whole buddy blocks, map them page by page instead
+    if(heap->is_supervisor && size >= KHEAP_VMALLOC_THRESHOLD){
+        return vmalloc(size);
+    }
     buddy_state_t* state = (buddy_state_t*)heap->state;
     
-    //total req size (header + data + alignment)
-    size_t total_size = size + sizeof(alloc_block_hdr);
-    total_size = (total_size + 7) & ~7;
-    
-    //determine req order
+    //orders live in block_orders rather than a header, so power-of-two
+    //requests take exactly their size, an 8KB buffer an 8KB block
     uint32_t order = state->min_order;
-    while(order_to_size(order) < total_size && order <= state->max_order){
+    while(order_to_size(order) < size && order <= state->max_order){
         order++;
     }
     if(order > state->max_order){
         return NULL;
     }
-    
-    //find first free
-    uint32_t current_order = order;
-    while(current_order <= state->max_order && !state->free_lists[current_order]){
-        current_order++;
+    state->busy = 1;
+    uintptr_t block = buddy_alloc(state, order);
+    while(!block && heap_grow(state)){
+        block = buddy_alloc(state, order);
     }
-    if(current_order > state->max_order){
-        return NULL;
-    }
-    
-    //split larger blocks to req order
-    while(current_order > order){
-        free_block_hdr* block = list_pop(&state->free_lists[current_order]);
-        current_order--;
-        size_t half_size = order_to_size(current_order);
-        uintptr_t first_half = (uintptr_t)block;
-        uintptr_t second_half = first_half + half_size;
-        //add both halves to the smaller free list
-        list_push(&state->free_lists[current_order], (free_block_hdr*)first_half);
-        list_push(&state->free_lists[current_order], (free_block_hdr*)second_half);
+    if(block){
+        block_order_set(state, block, order);
     }
-    
-    //allocate
-    free_block_hdr* block = list_pop(&state->free_lists[order]);
-    alloc_block_hdr* hdr = (alloc_block_hdr*)block;
-    hdr->size = order_to_size(order);
-    hdr->magic = BUDDY_MAGIC;
-    
-    return (void*)((uintptr_t)block + sizeof(alloc_block_hdr));
+    state->busy = 0;
+    return (void*)block;
 }
 
 void kfree(heap_t *heap, void *ptr){
     if(!heap || !ptr){
         return;
     }
+    if(is_vmalloc_addr(ptr)){
+        vfree(ptr);
+        return;
+    }
     buddy_state_t* state = (buddy_state_t*)heap->state;
+    uintptr_t addr = (uintptr_t)ptr;
+    if(addr < state->base || addr >= state->base + order_to_size(state->max_order)){
+        return;
+    }
     
-    //retrieve allocation header
-    uintptr_t hdr_addr = (uintptr_t)ptr - sizeof(alloc_block_hdr);
-    alloc_block_hdr* hdr = (alloc_block_hdr*)hdr_addr;
-    
-    //validate magic no
-    if(hdr->magic != BUDDY_MAGIC){
-        // LOG_ERROR("Invalid free: bad magic at 0x%x", ptr);
+    //clearing the entry catches double frees
+    uint32_t order = block_order_of(state, addr);
+    if(!order){
+        // LOG_ERROR("Invalid free at 0x%x", ptr);
         return;
     }
-    size_t block_size = hdr->size;
-    uint32_t order = log2_floor(block_size);
+    state->busy = 1;
+    block_order_set(state, addr, 0);
+    buddy_free(state, addr, order);
+    state->busy = 0;
+}
+
+//unmap the frames behind large free blocks, the first page of each stays
+//since it holds the list links, touching the rest again faults frames back in
+//so a block carved from one later is only partly backed, see kmalloc
+//returns the number of frames given back to kmm
+uint32_t kheap_shrink(heap_t *heap, uint32_t wanted){
+    if(!heap || !heap->state){
+        return 0;
+    }
+    buddy_state_t* state = (buddy_state_t*)heap->state;
+    if(state->busy){
+        return 0;  //called from a fault inside kmalloc or kfree
+    }
+    state->busy = 1;
+    heap_resident(state);  //peak before the drop
     
-    //invalidate magic to detect double-free
-    hdr->magic = 0;
-    uintptr_t block_addr = hdr_addr;
-    while(order < state->max_order){
-        uintptr_t buddy_addr = get_buddy_addr(state->base, block_addr, block_size);
-        //check if buddy is free
-        free_block_hdr* buddy = NULL;
-        for(free_block_hdr* node = state->free_lists[order]; node; node = node->next){
-            if((uintptr_t)node == buddy_addr){
-                buddy = node;
-                break;
+    pagedir_t* pdir = vmm_get_kerneldir();
+    uint32_t released = 0;
+    for(uint32_t order = state->max_order; order >= KHEAP_SHRINK_ORDER && released < wanted; order--){
+        for(free_block_hdr* node = state->free_lists[order]; node && released < wanted; node = node->next){
+            uintptr_t tail = (uintptr_t)node + VMM_PAGE_SIZE;
+            uintptr_t end = (uintptr_t)node + order_to_size(order);
+            uint32_t resident = count_resident(tail, end);
+            if(resident > 0){
+                vmm_free_region(pdir, (void*)tail, end - tail);
+                released += resident;
             }
         }
-        if(!buddy){
-            break;
-        }
-        
-        //remove buddy from free list
-        list_remove(&state->free_lists[order], buddy);
-        
-        //merge blocks
-        if(buddy_addr < block_addr){
-            block_addr = buddy_addr;
-        }
-        order++;
-        block_size *= 2;
     }
-    
-    //insert merged into free
-    free_block_hdr* free_block = (free_block_hdr*)block_addr;
-    free_block->next = NULL;
-    free_block->prev = NULL;
-    list_push(&state->free_lists[order], free_block);
+    state->released += released * VMM_PAGE_SIZE;
+    state->busy = 0;
+    return released;
 }
 
 void* krealloc(heap_t *heap, void *ptr, size_t new_size){
@@ -253,18 +432,28 @@ void* krealloc(heap_t *heap, void *ptr, size_t new_size){
         kfree(heap, ptr);
         return NULL;
     }
-    //retrieve
-    uintptr_t hdr_addr = (uintptr_t)ptr - sizeof(alloc_block_hdr);
-    alloc_block_hdr* hdr = (alloc_block_hdr*)hdr_addr;
-    
-    //validate
-    if(hdr->magic != BUDDY_MAGIC){
+    if(is_vmalloc_addr(ptr)){
+        size_t old_size = vmalloc_size(ptr);
+        if(new_size <= old_size){
+            return ptr;
+        }
+        void* new_ptr = kmalloc(heap, new_size);
+        if(new_ptr){
+            memcpy(new_ptr, ptr, old_size);
+            vfree(ptr);
+        }
+        return new_ptr;
+    }
+    //usable bytes of the current block
+    buddy_state_t* state = (buddy_state_t*)heap->state;
+    uint32_t order = block_order_of(state, (uintptr_t)ptr);
+    if(!order){
         return NULL;
     }
+    size_t old_size = order_to_size(order);
     
     //check if current block can fit new size
-    size_t required_size = new_size + sizeof(alloc_block_hdr);
-    if(required_size <= hdr->size){
+    if(new_size <= old_size){
         return ptr; //reuse existing
     }
     
@@ -275,7 +464,7 @@ void* krealloc(heap_t *heap, void *ptr, size_t new_size){
     }
     
     //copy old
-    size_t copy_size = hdr->size - sizeof(alloc_block_hdr);
+    size_t copy_size = old_size;
     if(copy_size > new_size){
         copy_size = new_size;
     }
@@ -291,7 +480,9 @@ void kheap_stats(heap_t *heap){
     }
     buddy_state_t* state = (buddy_state_t*)heap->state;
     
+    heap_resident(state);  //samples the peak as well
     // LOG_DEBUG("Heap Statistics: Base: 0x%x, Size: %u KB", state->base, state->size / 1024);
+    // LOG_DEBUG("Grown: %u KB, resident: %u KB, peak %u KB", (state->grown - state->base) / 1024, heap_resident(state) / 1024, state->resident_peak / 1024);
     // LOG_DEBUG("Orders: %u - %u", state->min_order, state->max_order);
     
     for(uint32_t order = state->min_order; order <= state->max_order; order++){
@@ -305,6 +496,25 @@ void kheap_stats(heap_t *heap){
     }
 }
 
+//bytes of the heap backed by frames right now, the peak seen so far and
+//how much the shrinker has handed back
+size_t kheap_get_resident(heap_t *heap){
+    return (heap && heap->state) ? heap_resident((buddy_state_t*)heap->state) : 0;
+}
+
+size_t kheap_get_resident_peak(heap_t *heap){
+    if(!heap || !heap->state){
+        return 0;
+    }
+    buddy_state_t* state = (buddy_state_t*)heap->state;
+    heap_resident(state);
+    return state->resident_peak;
+}
+
+size_t kheap_get_released(heap_t *heap){
+    return (heap && heap->state) ? ((buddy_state_t*)heap->state)->released : 0;
+}
+
 //public wrappers
 heap_t* get_kernel_heap(void){
     return &kernel_heap;
@@ -1,15 +1,130 @@
 #include "../include/mm/kmm.h"
 #include <../include/mem.h>
+#include <../include/interrupts.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+
+#define KMM_MAX_ORDER 10          //largest block is 1024 frames (4MB)
+#define KMM_ZONE_DMA 0
+#define KMM_ZONE_NORMAL 1
+#define KMM_ZONE_HIGHMEM 2        //no permanent kernel mapping, user pages and kmap only
+#define KMM_ZONE_COUNT 3
+#define DMA_ZONE_LIMIT 0x1000000  //ISA DMA can only reach the first 16MB
+#define LOWMEM_LIMIT 0x38000000   //physmap size, the rest of kernel space is vmalloc and kmap
+#ifdef CONFIG_PAE
+#define KMM_PHYS_LIMIT 0x1000000000ULL  //64GB, what PAE can address
+#else
+#define KMM_PHYS_LIMIT 0x100000000ULL
+#endif
+#define E820_USABLE 1
+#define FRAME_NONE 0xFFFFFFFF
+#define ORDER_NONE 0xFF
+#define KMM_REFCOUNT_MAX 0xFFFF   //refcount saturates here and the frame is never freed
+#define ZERO_POOL_SIZE 64
+#define KMM_MAX_CPUS 8
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH 16         //frames moved per refill or drain
+#define KMM_MAX_SHRINKERS 4
+#define BOOT_LARGE_PAGE 0x400000  //boot tables are non-pae, a pde maps 4MB
+#define BOOT_MAP_SLACK 0x400000   //room past the descriptors for vmm_init's own tables
+#define CR4_PSE 0x10
+#define SHRINK_BATCH 16           //frames asked back per failed allocation
+
+//page flags
+#define PAGE_ZONE_MASK 0x03  //zone tag, one of KMM_ZONE_*
+#define PAGE_RESERVED 0x04   //never handed to the buddy allocator
+#define PAGE_MOVABLE 0x08    //user data, compaction may migrate it
+#define PAGE_ISOLATED 0x10   //held back from the buddy lists during compaction
+
+//per frame descriptor, indexed by frame number
+struct page{
+    union{
+        struct{
+            uint32_t next;   //buddy free list links (frame numbers)
+            uint32_t prev;
+        };
+        uint32_t private;    //owner's word while allocated, e.g. present ptes of a page table
+    };
+    uint16_t refcount;
+    uint8_t order;       //order of the free block starting here, ORDER_NONE otherwise
+    uint8_t flags;
+};
+
+//per cpu stack of free order-0 frames, kept out of the buddy lists
+typedef struct{
+    uint32_t count;
+    uint32_t frames[MAGAZINE_SIZE];
+} magazine_t;
+
+//moves every mapping of frames in [start_frame, start_frame + count), returns frames moved
+typedef uint32_t (*kmm_migrate_fn)(uint32_t start_frame, uint32_t count);
+
+typedef struct{
+    uint32_t start_frame;
+    uint32_t end_frame;
+    uint32_t free_lists[KMM_MAX_ORDER + 1];  //head frame of each order
+    uint32_t free_blocks[KMM_MAX_ORDER + 1];
+} zone_t;
+
+static uint32_t* memory_bitmap = NULL;  //set = frame not in any free list
+static struct page* pages = NULL;
+static zone_t zones[KMM_ZONE_COUNT];
+static magazine_t magazines[KMM_MAX_CPUS];
+static volatile uint32_t buddy_lock = 0;  //guards zones, bitmap and used_frames
+
+//compaction
+static kmm_migrate_fn migrate_handler = NULL;
+static uint32_t isolate_start = 0;  //window being emptied, frames freed inside it stay isolated
+static uint32_t isolate_end = 0;
+static uint32_t compact_last_moved = 0;
+static uint64_t compact_last_cycles = 0;
+static uint32_t compact_total_moved = 0;
+
+//caches that can give frames back under pressure
+static kmm_shrink_fn shrinkers[KMM_MAX_SHRINKERS];
+static uint32_t shrinker_count = 0;
+static volatile uint32_t shrinking = 0;  //a shrinker allocating must not recurse
+static uint32_t shrink_total_released = 0;
 
-static uint32_t* memory_bitmap = NULL;
 static uint32_t total_frames = 0;
+static uint32_t lowmem_frames = 0;      //frames the physmap covers
 static uint32_t used_frames = 0;
 static uint32_t bitmap_size = 0;
+
+//pre-zeroed frames, refilled by the idle thread with interrupts off, still counted as used
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static uint32_t zero_pool_hits = 0;
+static uint32_t zero_pool_misses = 0;
+
 extern uint32_t kernel_start;
 extern uint32_t kernel_end;
 
+//no SMP bring-up yet, everything runs on the boot cpu
+static inline uint32_t kmm_cpu_id(void){
+    return 0;
+}
+
+static inline uint32_t kmm_lock(void){
+    uint32_t eflags = irq_save();
+    while(__atomic_exchange_n(&buddy_lock, 1, __ATOMIC_ACQUIRE)){
+        asm volatile("pause");
+    }
+    return eflags;
+}
+
+static inline void kmm_unlock(uint32_t eflags){
+    __atomic_store_n(&buddy_lock, 0, __ATOMIC_RELEASE);
+    irq_restore(eflags);
+}
+
+static inline uint64_t rdtsc(void){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 //make used frames
 static void mark_frame(uint32_t frame){
     uint32_t idx = frame / 32;
@@ -31,49 +146,178 @@ static bool isframe_used(uint32_t frame){
     return (memory_bitmap[idx] & (1 << bit)) != 0;
 }
 
-//first free frame
-static uint32_t find_first_free(void){
-    for(uint32_t i = 0; i < bitmap_size; i++){
-        if(memory_bitmap[i] != 0xFFFFFFFF){
-            for(uint32_t j = 0; j < 32; j++){
-                uint32_t frame = i * 32 + j;
-                if(frame >= total_frames){
-                    return (uint32_t)-1;
-                }
-                if(!isframe_used(frame)){
-                    return frame;
-                }
-            }
+static zone_t* frame_zone(uint32_t frame){
+    return &zones[pages[frame].flags & PAGE_ZONE_MASK];
+}
+
+static void free_list_push(zone_t* zone, uint32_t frame, uint32_t order){
+    uint32_t head = zone->free_lists[order];
+    pages[frame].next = head;
+    pages[frame].prev = FRAME_NONE;
+    if(head != FRAME_NONE){
+        pages[head].prev = frame;
+    }
+    zone->free_lists[order] = frame;
+    zone->free_blocks[order]++;
+    pages[frame].order = order;
+}
+
+static void free_list_remove(zone_t* zone, uint32_t frame, uint32_t order){
+    struct page* page = &pages[frame];
+    if(page->prev != FRAME_NONE){
+        pages[page->prev].next = page->next;
+    }
+    else{
+        zone->free_lists[order] = page->next;
+    }
+    if(page->next != FRAME_NONE){
+        pages[page->next].prev = page->prev;
+    }
+    zone->free_blocks[order]--;
+    page->order = ORDER_NONE;
+}
+
+static uint32_t buddy_alloc(zone_t* zone, uint32_t order){
+    //smallest order with a free block
+    uint32_t current_order = order;
+    while(current_order <= KMM_MAX_ORDER && zone->free_lists[current_order] == FRAME_NONE){
+        current_order++;
+    }
+    if(current_order > KMM_MAX_ORDER){
+        return FRAME_NONE;
+    }
+    uint32_t frame = zone->free_lists[current_order];
+    free_list_remove(zone, frame, current_order);
+
+    //split, giving the upper halves back
+    while(current_order > order){
+        current_order--;
+        free_list_push(zone, frame + (1 << current_order), current_order);
+    }
+
+    for(uint32_t i = 0; i < (1U << order); i++){
+        mark_frame(frame + i);
+        pages[frame + i].refcount = 1;
+    }
+    used_frames += 1 << order;
+    return frame;
+}
+
+//put a block on its zone's free lists, merging while the buddy is a free
+//block of the same order in this zone
+static void buddy_insert(uint32_t frame, uint32_t order){
+    zone_t* zone = frame_zone(frame);
+    while(order < KMM_MAX_ORDER){
+        uint32_t buddy = frame ^ (1 << order);
+        if(buddy < zone->start_frame || buddy + (1 << order) > zone->end_frame){
+            break;
+        }
+        if(pages[buddy].order != order){
+            break;
         }
+        free_list_remove(zone, buddy, order);
+        if(buddy < frame){
+            frame = buddy;
+        }
+        order++;
     }
-    return (uint32_t)-1;
+    free_list_push(zone, frame, order);
 }
 
-void kmm_setup_memory_region(uint32_t base, uint32_t size, bool is_reserved){
-    uint32_t start_frame = base / _KMM_BLOCK_SIZE;
-    uint32_t end_frame = (base + size) / _KMM_BLOCK_SIZE;
-    
+static void buddy_free(uint32_t frame, uint32_t order){
+    for(uint32_t i = 0; i < (1U << order); i++){
+        unmark_frame(frame + i);
+        pages[frame + i].refcount = 0;
+        pages[frame + i].flags &= ~(PAGE_MOVABLE | PAGE_ISOLATED);
+    }
+    used_frames -= 1 << order;
+    buddy_insert(frame, order);
+}
+
+//order of the smallest block holding count frames
+static uint32_t count_to_order(uint32_t count){
+    uint32_t order = 0;
+    while((1U << order) < count){
+        order++;
+    }
+    return order;
+}
+
+//e820 ranges are 64-bit, anything past what we can address is dropped
+static void setup_region64(uint64_t base, uint64_t length, bool is_reserved){
+    uint64_t end = base + length;
+    if(base >= KMM_PHYS_LIMIT){
+        return;
+    }
+    if(end > KMM_PHYS_LIMIT){
+        end = KMM_PHYS_LIMIT;
+    }
+    uint32_t start_frame = (uint32_t)(base / _KMM_BLOCK_SIZE);
+    uint32_t end_frame = (uint32_t)(end / _KMM_BLOCK_SIZE);
+
     for(uint32_t frame = start_frame; frame < end_frame && frame < total_frames; frame++){
-        if(is_reserved){
+        if(is_reserved && !isframe_used(frame)){
             mark_frame(frame);
             used_frames++;
         }
-        else{
+        else if(!is_reserved && isframe_used(frame)){
             unmark_frame(frame);
             used_frames--;
         }
     }
 }
 
+void kmm_setup_memory_region(uint32_t base, uint32_t size, bool is_reserved){
+    setup_region64(base, size, is_reserved);
+}
+
+//the boot tables only cover the start of the kernel half, but the bitmap,
+//the frame descriptors and the frames vmm_init builds the physmap in are all
+//written through PHYS_TO_VIRT before it exists, so map [0, end) with 4MB
+//pages in the boot directory first, a present boot pde is left as it is
+static void boot_map_range(uint32_t end){
+    uintptr_t cr3, cr4;  //register width, so the host bench harness compiles this too
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PSE) : "memory");
+    uint32_t* boot_dir = (uint32_t*)PHYS_TO_VIRT(cr3 & ~0xFFF);
+    for(uint32_t pa = 0; pa < end && pa < LOWMEM_LIMIT; pa += BOOT_LARGE_PAGE){
+        uintptr_t va = (uintptr_t)PHYS_TO_VIRT(pa);
+        if(!(boot_dir[va >> 22] & 0x1)){
+            boot_dir[va >> 22] = pa | 0x83;  //present, writable, 4MB
+            asm volatile("invlpg (%0)" :: "r"(va) : "memory");
+        }
+    }
+}
+
 void kmm_init(void){
-    e801_memsize_t* memsize = (e801_memsize_t*)MEM_SIZE_LOC;
-    uint32_t total_memory = (1024 * 1024);
-    total_memory += memsize->memLow * 1024;
-    total_memory += memsize->memHigh * 64 * 1024;
-    
-    total_frames = total_memory / _KMM_BLOCK_SIZE;
+    uint32_t* entry_count_ptr = (uint32_t*)MEM_MAP_ENTRY_COUNT_LOC;
+    uint32_t entry_count = *entry_count_ptr;
+    e820_entry_t* memory_map = (e820_entry_t*)MEM_MAP_LOC;
+
+    //size from the end of the highest usable e820 range, e801 stops at 4GB
+    uint64_t total_memory = 0;
+    for(uint32_t i = 0; i < entry_count; i++){
+        e820_entry_t* entry = &memory_map[i];
+        uint64_t end = (((uint64_t)entry->baseHigh << 32) | entry->baseLow) + (((uint64_t)entry->lengthHigh << 32) | entry->lengthLow);
+        if(entry->type == E820_USABLE && end > total_memory){
+            total_memory = end;
+        }
+    }
+    if(total_memory == 0){
+        e801_memsize_t* memsize = (e801_memsize_t*)MEM_SIZE_LOC;
+        total_memory = (1024 * 1024);
+        total_memory += memsize->memLow * 1024;
+        total_memory += (uint64_t)memsize->memHigh * 64 * 1024;
+    }
+    if(total_memory > KMM_PHYS_LIMIT){
+        total_memory = KMM_PHYS_LIMIT;
+    }
+
+    total_frames = (uint32_t)(total_memory / _KMM_BLOCK_SIZE);
+    lowmem_frames = (total_frames < LOWMEM_LIMIT / _KMM_BLOCK_SIZE) ? total_frames : LOWMEM_LIMIT / _KMM_BLOCK_SIZE;
     bitmap_size = (total_frames + 31) / 32;
-    
+
     uint32_t kernel_start_virt = (uint32_t)&kernel_start;
     uint32_t kernel_end_virt = (uint32_t)&kernel_end;
     uint32_t kernel_start_phys = (uint32_t)VIRT_TO_PHYS(&kernel_start);
@@ -82,75 +326,602 @@ void kmm_init(void){
     uint32_t kernel_end_virt_aligned = (kernel_end_virt + _KMM_BLOCK_ALIGNMENT - 1) & ~(_KMM_BLOCK_ALIGNMENT - 1);
     memory_bitmap = (uint32_t*)kernel_end_virt_aligned;  //access through virtual
     uint32_t bitmap_phys = (uint32_t)VIRT_TO_PHYS(kernel_end_virt_aligned);
-    
+
+    //frame descriptors follow the bitmap, about 28MB with 8GB of ram
+    pages = (struct page*)(memory_bitmap + bitmap_size);
+    uint32_t descriptors_end = bitmap_phys + bitmap_size * sizeof(uint32_t) + total_frames * sizeof(struct page);
+    boot_map_range((descriptors_end > DMA_ZONE_LIMIT ? descriptors_end : DMA_ZONE_LIMIT) + BOOT_MAP_SLACK);
+
     for(uint32_t i = 0; i < bitmap_size; i++){
         memory_bitmap[i] = 0xFFFFFFFF;
     }
+    for(uint32_t i = 0; i < total_frames; i++){
+        pages[i].next = FRAME_NONE;
+        pages[i].prev = FRAME_NONE;
+        pages[i].refcount = 0;
+        pages[i].order = ORDER_NONE;
+        if(i < DMA_ZONE_LIMIT / _KMM_BLOCK_SIZE){
+            pages[i].flags = KMM_ZONE_DMA;
+        }
+        else{
+            pages[i].flags = (i < lowmem_frames) ? KMM_ZONE_NORMAL : KMM_ZONE_HIGHMEM;
+        }
+    }
     used_frames = total_frames;
-    uint32_t* entry_count_ptr = (uint32_t*)MEM_MAP_ENTRY_COUNT_LOC;
-    uint32_t entry_count = *entry_count_ptr;
-    e820_entry_t* memory_map = (e820_entry_t*)MEM_MAP_LOC;
-    
+
     for(uint32_t i = 0; i < entry_count; i++){
         e820_entry_t* entry = &memory_map[i];
-        if(entry->type == 1){
-            kmm_setup_memory_region(entry->baseLow, entry->lengthLow, false);
+        if(entry->type == E820_USABLE){
+            setup_region64(((uint64_t)entry->baseHigh << 32) | entry->baseLow, ((uint64_t)entry->lengthHigh << 32) | entry->lengthLow, false);
         }
     }
-    
+
     kmm_setup_memory_region(0, 0x100000, true);  //first 1MB
-    
+
     uint32_t kernel_size = kernel_end_phys - kernel_start_phys;
     kmm_setup_memory_region(kernel_start_phys, kernel_size, true);  //kernel
-    
-    uint32_t bitmap_memory_size = bitmap_size * sizeof(uint32_t);
+
+    uint32_t bitmap_memory_size = bitmap_size * sizeof(uint32_t) + total_frames * sizeof(struct page);
     bitmap_memory_size = (bitmap_memory_size + _KMM_BLOCK_SIZE - 1) & ~(_KMM_BLOCK_SIZE - 1);
-    kmm_setup_memory_region(bitmap_phys, bitmap_memory_size, true);  //bitmap
+    kmm_setup_memory_region(bitmap_phys, bitmap_memory_size, true);  //bitmap + frame descriptors
+
+    //zones
+    uint32_t dma_end = DMA_ZONE_LIMIT / _KMM_BLOCK_SIZE;
+    if(dma_end > total_frames){
+        dma_end = total_frames;
+    }
+    zones[KMM_ZONE_DMA].start_frame = 0;
+    zones[KMM_ZONE_DMA].end_frame = dma_end;
+    zones[KMM_ZONE_NORMAL].start_frame = dma_end;
+    zones[KMM_ZONE_NORMAL].end_frame = lowmem_frames;
+    zones[KMM_ZONE_HIGHMEM].start_frame = lowmem_frames;
+    zones[KMM_ZONE_HIGHMEM].end_frame = total_frames;
+    for(uint32_t z = 0; z < KMM_ZONE_COUNT; z++){
+        for(uint32_t order = 0; order <= KMM_MAX_ORDER; order++){
+            zones[z].free_lists[order] = FRAME_NONE;
+            zones[z].free_blocks[order] = 0;
+        }
+    }
+
+    //hand every usable frame to the buddy allocator, merging as we go
+    //top down, so the lowest block ends up at the head of each list and the
+    //first frames handed out sit right above the kernel, like the bitmap
+    //allocator did, vmm_init still builds its tables through the boot mapping
+    for(uint32_t frame = total_frames; frame-- > 0;){
+        if(!isframe_used(frame)){
+            buddy_insert(frame, 0);
+        }
+        else{
+            pages[frame].flags |= PAGE_RESERVED;
+        }
+    }
+}
+
+//move up to MAGAZINE_BATCH frames from the buddy lists into a magazine
+static void magazine_refill(magazine_t* mag){
+    uint32_t eflags = kmm_lock();
+    while(mag->count < MAGAZINE_BATCH){
+        uint32_t frame = buddy_alloc(&zones[KMM_ZONE_NORMAL], 0);
+        if(frame == FRAME_NONE){
+            frame = buddy_alloc(&zones[KMM_ZONE_DMA], 0);
+        }
+        if(frame == FRAME_NONE){
+            break;
+        }
+        pages[frame].refcount = 0;
+        mag->frames[mag->count++] = frame;
+    }
+    kmm_unlock(eflags);
+}
+
+//give count frames from the top of a magazine back to the buddy lists
+static void magazine_drain(magazine_t* mag, uint32_t count){
+    uint32_t eflags = kmm_lock();
+    while(count-- > 0 && mag->count > 0){
+        uint32_t frame = mag->frames[--mag->count];
+        pages[frame].refcount = 1;
+        buddy_free(frame, 0);
+    }
+    kmm_unlock(eflags);
+}
+
+//flush every magazine, for callers that need the buddy lists complete
+//remote magazines are touched directly, which is only safe while there is one cpu
+void kmm_drain_magazines(void){
+    for(uint32_t cpu = 0; cpu < KMM_MAX_CPUS; cpu++){
+        uint32_t eflags = irq_save();
+        magazine_drain(&magazines[cpu], MAGAZINE_SIZE);
+        irq_restore(eflags);
+    }
+}
+
+//ask the registered caches for up to wanted frames, returns how many came back
+static uint32_t run_shrinkers(uint32_t wanted){
+    uint32_t eflags = irq_save();
+    if(shrinking){
+        irq_restore(eflags);
+        return 0;
+    }
+    shrinking = 1;
+    irq_restore(eflags);
+
+    uint32_t released = 0;
+    for(uint32_t i = 0; i < shrinker_count && released < wanted; i++){
+        released += shrinkers[i](wanted - released);
+    }
+    shrink_total_released += released;
+    shrinking = 0;
+    return released;
+}
+
+//a frame from this cpu's magazine, refilled from the buddy lists, and nothing
+//else, FRAME_NONE when both are empty
+static uint32_t magazine_alloc(void){
+    uint32_t frame = FRAME_NONE;
+    uint32_t eflags = irq_save();
+    magazine_t* mag = &magazines[kmm_cpu_id()];
+    if(mag->count == 0){
+        magazine_refill(mag);
+    }
+    if(mag->count > 0){
+        frame = mag->frames[--mag->count];
+        pages[frame].refcount = 1;
+    }
+    irq_restore(eflags);
+    return frame;
 }
 
 void* kmm_frame_alloc(void){
-    uint32_t frame = find_first_free();
-    
-    while(frame != (uint32_t)-1 && frame < 256){
-        mark_frame(frame);
-        used_frames++;
-        frame = find_first_free();
-    }
-    
-    if(frame == (uint32_t)-1){
-        return NULL;
+    //first 1MB (frames < 256) is reserved in kmm_init, never handed out here
+    //fast path only touches this cpu's magazine
+    uint32_t frame = magazine_alloc();
+    if(frame == FRAME_NONE){
+        //last resort, frames parked in the zero pool
+        void* phys = NULL;
+        uint32_t eflags = irq_save();
+        if(zero_pool_count > 0){
+            phys = (void*)zero_pool[--zero_pool_count];
+        }
+        irq_restore(eflags);
+        //then whatever the caches can spare, the frames land in the magazines
+        if(!phys && run_shrinkers(SHRINK_BATCH) > 0){
+            return kmm_frame_alloc();
+        }
+        return phys;
     }
-    
-    mark_frame(frame);
-    used_frames++;
     return (void*)(frame * _KMM_BLOCK_SIZE);
 }
 
+//a frame that reads as zero, from the pool when possible
+void* kmm_frame_alloc_zeroed(void){
+    void* phys = NULL;
+    uint32_t eflags = irq_save();
+    if(zero_pool_count > 0){
+        phys = (void*)zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+    }
+    else{
+        zero_pool_misses++;
+    }
+    irq_restore(eflags);
+
+    if(!phys){
+        phys = kmm_frame_alloc();
+        if(phys){
+            memset(PHYS_TO_VIRT(phys), 0, _KMM_BLOCK_SIZE);
+        }
+    }
+    return phys;
+}
+
+//zero one more frame into the pool, false when it is full or memory ran out
+//called from the idle thread, zeroing runs with interrupts enabled
+//only free frames go in, never the pool's own or ones the shrinkers free up
+bool kmm_zero_pool_refill(void){
+    uint32_t eflags = irq_save();
+    void* phys = NULL;
+    if(zero_pool_count < ZERO_POOL_SIZE){
+        uint32_t frame = magazine_alloc();
+        if(frame != FRAME_NONE){
+            phys = (void*)(frame * _KMM_BLOCK_SIZE);
+        }
+    }
+    irq_restore(eflags);
+    if(!phys){
+        return false;
+    }
+
+    memset(PHYS_TO_VIRT(phys), 0, _KMM_BLOCK_SIZE);
+
+    eflags = irq_save();
+    if(zero_pool_count < ZERO_POOL_SIZE){
+        zero_pool[zero_pool_count++] = (uint32_t)phys;
+        phys = NULL;
+    }
+    irq_restore(eflags);
+    if(phys){
+        kmm_frame_free(phys);  //someone else filled the pool meanwhile
+    }
+    return true;
+}
+
+uint32_t kmm_get_zero_pool_hits(void){
+    return zero_pool_hits;
+}
+
+uint32_t kmm_get_zero_pool_misses(void){
+    return zero_pool_misses;
+}
+
+//descriptor of an allocated frame, NULL for free, reserved or bad frame numbers
+static struct page* pfn_page(uint32_t frame){
+    if(frame >= total_frames || frame < 256){
+        return NULL;
+    }
+    struct page* page = &pages[frame];
+    if(!isframe_used(frame) || (page->flags & PAGE_RESERVED) || page->refcount == 0){
+        return NULL;  //frame wasn't allocated
+    }
+    return page;
+}
+
+static struct page* frame_page(void* phys_addr){
+    return phys_addr ? pfn_page((uint32_t)phys_addr / _KMM_BLOCK_SIZE) : NULL;
+}
+
+//frame numbers reach past 4GB with pae, these work on any frame
+//take another reference on an allocated frame so it can be shared, a frame
+//whose count reaches KMM_REFCOUNT_MAX stays pinned for good
+void kmm_pfn_get(uint32_t frame){
+    struct page* page = pfn_page(frame);
+    if(!page){
+        return;
+    }
+    uint16_t count = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    while(count < KMM_REFCOUNT_MAX){
+        if(__atomic_compare_exchange_n(&page->refcount, &count, count + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            break;
+        }
+    }
+}
+
+//drop a reference, the frame goes back to the buddy allocator with the last one
+void kmm_pfn_put(uint32_t frame){
+    struct page* page = pfn_page(frame);
+    if(!page){
+        return;
+    }
+    uint16_t count = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    do{
+        if(count == KMM_REFCOUNT_MAX){
+            return;  //gets past the cap went uncounted, so puts can't be trusted
+        }
+    } while(!__atomic_compare_exchange_n(&page->refcount, &count, count - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if(count != 1){
+        return;
+    }
+    page->flags &= ~PAGE_MOVABLE;
+
+    uint32_t eflags = kmm_lock();
+    //magazines only serve lowmem callers
+    if((page->flags & PAGE_ZONE_MASK) == KMM_ZONE_HIGHMEM){
+        page->refcount = 1;
+        buddy_free(frame, 0);
+        kmm_unlock(eflags);
+        return;
+    }
+    if(frame >= isolate_start && frame < isolate_end){
+        page->flags |= PAGE_ISOLATED;  //migrated away, keep it for the window
+        kmm_unlock(eflags);
+        return;
+    }
+    kmm_unlock(eflags);
+
+    //park it in this cpu's magazine, draining a batch when full
+    eflags = irq_save();
+    magazine_t* mag = &magazines[kmm_cpu_id()];
+    if(mag->count == MAGAZINE_SIZE){
+        magazine_drain(mag, MAGAZINE_BATCH);
+    }
+    mag->frames[mag->count++] = frame;
+    irq_restore(eflags);
+}
+
+uint32_t kmm_pfn_refcount(uint32_t frame){
+    struct page* page = pfn_page(frame);
+    return page ? page->refcount : 0;
+}
+
+void kmm_frame_get(void* phys_addr){
+    if(phys_addr){
+        kmm_pfn_get((uint32_t)phys_addr / _KMM_BLOCK_SIZE);
+    }
+}
+
+void kmm_frame_put(void* phys_addr){
+    if(phys_addr){
+        kmm_pfn_put((uint32_t)phys_addr / _KMM_BLOCK_SIZE);
+    }
+}
+
+//a frame for user pages, which the kernel reaches through kmap only
+//highmem first so lowmem stays for the kernel, returns 0 when out of memory
+uint32_t kmm_highmem_alloc(void){
+    uint32_t eflags = kmm_lock();
+    uint32_t frame = buddy_alloc(&zones[KMM_ZONE_HIGHMEM], 0);
+    kmm_unlock(eflags);
+    if(frame != FRAME_NONE){
+        return frame;
+    }
+    void* phys = kmm_frame_alloc();
+    return phys ? (uint32_t)phys / _KMM_BLOCK_SIZE : 0;
+}
+
+//flag a frame holding user data so compaction may move it
+void kmm_frame_mark_movable(void* phys_addr){
+    struct page* page = frame_page(phys_addr);
+    if(page){
+        page->flags |= PAGE_MOVABLE;
+    }
+}
+
+//keep an allocated frame for good, gets and puts leave it alone from now on
+void kmm_frame_reserve(void* phys_addr){
+    struct page* page = frame_page(phys_addr);
+    if(page){
+        page->flags |= PAGE_RESERVED;
+    }
+}
+
+//owner data of an allocated frame, not initialised by the allocator
+uint32_t kmm_frame_get_private(void* phys_addr){
+    struct page* page = frame_page(phys_addr);
+    return page ? page->private : 0;
+}
+
+void kmm_frame_set_private(void* phys_addr, uint32_t value){
+    struct page* page = frame_page(phys_addr);
+    if(page){
+        page->private = value;
+    }
+}
+
+uint32_t kmm_frame_refcount(void* phys_addr){
+    return phys_addr ? kmm_pfn_refcount((uint32_t)phys_addr / _KMM_BLOCK_SIZE) : 0;
+}
+
+//frees the caller's reference, shared frames stay allocated
 void kmm_frame_free(void* phys_addr){
+    kmm_frame_put(phys_addr);
+}
+
+static void* alloc_contig_zone(zone_t* zone, uint32_t count, uint32_t align){
+    if(count == 0 || align == 0 || (align & (align - 1)) != 0){
+        return NULL;
+    }
+    //buddy blocks are naturally aligned to their size
+    uint32_t order = count_to_order(count > align ? count : align);
+    if(order > KMM_MAX_ORDER){
+        return NULL;
+    }
+    uint32_t eflags = kmm_lock();
+    uint32_t frame = buddy_alloc(zone, order);
+    if(frame != FRAME_NONE){
+        //give back the tail past count
+        for(uint32_t i = count; i < (1U << order); i++){
+            buddy_free(frame + i, 0);
+        }
+    }
+    kmm_unlock(eflags);
+    if(frame == FRAME_NONE){
+        return NULL;
+    }
+    return (void*)(frame * _KMM_BLOCK_SIZE);
+}
+
+//aligned block of 2^order frames with the fewest used frames, all of them movable
+static uint32_t pick_compact_window(zone_t* zone, uint32_t order){
+    uint32_t size = 1 << order;
+    uint32_t best = FRAME_NONE;
+    uint32_t best_used = size;
+    uint32_t first = (zone->start_frame + size - 1) & ~(size - 1);
+
+    for(uint32_t start = first; start + size <= zone->end_frame; start += size){
+        uint32_t used = 0;
+        for(uint32_t frame = start; frame < start + size; frame++){
+            if(!isframe_used(frame)){
+                continue;
+            }
+            struct page* page = &pages[frame];
+            if(!(page->flags & PAGE_MOVABLE) || page->refcount != 1){
+                used = size;  //pinned, this window can never be emptied
+                break;
+            }
+            used++;
+        }
+        if(used < best_used){
+            best_used = used;
+            best = start;
+        }
+    }
+    return best;
+}
+
+//pull the free blocks inside the window off the buddy lists
+static void isolate_window(zone_t* zone, uint32_t start, uint32_t size){
+    for(uint32_t frame = start; frame < start + size;){
+        uint32_t order = pages[frame].order;
+        if(order == ORDER_NONE){
+            frame++;
+            continue;
+        }
+        free_list_remove(zone, frame, order);
+        for(uint32_t i = 0; i < (1U << order); i++){
+            mark_frame(frame + i);
+            pages[frame + i].flags |= PAGE_ISOLATED;
+        }
+        used_frames += 1 << order;
+        frame += 1 << order;
+    }
+    isolate_start = start;
+    isolate_end = start + size;
+}
+
+//hand isolated frames back, as one block when the window emptied completely
+static void release_window(uint32_t start, uint32_t size){
+    uint32_t isolated = 0;
+    for(uint32_t frame = start; frame < start + size; frame++){
+        if(pages[frame].flags & PAGE_ISOLATED){
+            isolated++;
+        }
+    }
+    if(isolated == size){
+        buddy_free(start, count_to_order(size));
+    }
+    else{
+        for(uint32_t frame = start; frame < start + size; frame++){
+            if(pages[frame].flags & PAGE_ISOLATED){
+                buddy_free(frame, 0);
+            }
+        }
+    }
+    isolate_start = 0;
+    isolate_end = 0;
+}
+
+//migrate movable frames out of one 2^order window of the zone so it can merge
+static bool compact_zone(zone_t* zone, uint32_t order){
+    if(!migrate_handler){
+        return false;
+    }
+    uint64_t begin = rdtsc();
+    kmm_drain_magazines();
+
+    uint32_t eflags = kmm_lock();
+    uint32_t start = pick_compact_window(zone, order);
+    if(start == FRAME_NONE){
+        kmm_unlock(eflags);
+        return false;
+    }
+    isolate_window(zone, start, 1 << order);
+    kmm_unlock(eflags);
+
+    //the handler allocates and frees, so it runs unlocked
+    uint32_t moved = migrate_handler(start, 1 << order);
+
+    eflags = kmm_lock();
+    release_window(start, 1 << order);
+    kmm_unlock(eflags);
+
+    compact_last_moved = moved;
+    compact_last_cycles = rdtsc() - begin;
+    compact_total_moved += moved;
+    return moved > 0;
+}
+
+//set by whoever can find and rewrite user mappings
+void kmm_register_migrate_handler(kmm_migrate_fn handler){
+    migrate_handler = handler;
+}
+
+//called with the number of frames wanted, returns how many it freed
+bool kmm_register_shrinker(kmm_shrink_fn shrinker){
+    if(!shrinker || shrinker_count >= KMM_MAX_SHRINKERS){
+        return false;
+    }
+    shrinkers[shrinker_count++] = shrinker;
+    return true;
+}
+
+uint32_t kmm_get_shrink_released(void){
+    return shrink_total_released;
+}
+
+//frames moved and tsc cycles spent by the last compaction pass
+uint32_t kmm_get_compact_moved(void){
+    return compact_last_moved;
+}
+
+uint64_t kmm_get_compact_cycles(void){
+    return compact_last_cycles;
+}
+
+uint32_t kmm_get_compact_total_moved(void){
+    return compact_total_moved;
+}
+
+//count frames starting on a multiple of align frames (power of two), at most 4MB
+//prefers memory above the DMA zone and falls back to it when that is full
+void* kmm_frame_alloc_contig(uint32_t count, uint32_t align){
+    void* phys = alloc_contig_zone(&zones[KMM_ZONE_NORMAL], count, align);
+    if(!phys){
+        phys = alloc_contig_zone(&zones[KMM_ZONE_DMA], count, align);
+    }
+    if(!phys){
+        //cached frames may be holding the missing buddies
+        kmm_drain_magazines();
+        phys = alloc_contig_zone(&zones[KMM_ZONE_NORMAL], count, align);
+        if(!phys){
+            phys = alloc_contig_zone(&zones[KMM_ZONE_DMA], count, align);
+        }
+    }
+    if(!phys){
+        //fragmented, move user frames out of the way and try once more
+        uint32_t order = count_to_order(count > align ? count : align);
+        if(order <= KMM_MAX_ORDER && compact_zone(&zones[KMM_ZONE_NORMAL], order)){
+            phys = alloc_contig_zone(&zones[KMM_ZONE_NORMAL], count, align);
+        }
+    }
+    return phys;
+}
+
+//same as kmm_frame_alloc_contig but the whole run lies below 16MB
+void* kmm_frame_alloc_contig_dma(uint32_t count, uint32_t align){
+    void* phys = alloc_contig_zone(&zones[KMM_ZONE_DMA], count, align);
+    if(!phys){
+        kmm_drain_magazines();
+        phys = alloc_contig_zone(&zones[KMM_ZONE_DMA], count, align);
+    }
+    if(!phys){
+        uint32_t order = count_to_order(count > align ? count : align);
+        if(order <= KMM_MAX_ORDER && compact_zone(&zones[KMM_ZONE_DMA], order)){
+            phys = alloc_contig_zone(&zones[KMM_ZONE_DMA], count, align);
+        }
+    }
+    return phys;
+}
+
+void kmm_frame_free_contig(void* phys_addr, uint32_t count){
     if(phys_addr == NULL){
         return;
     }
-    
-    uint32_t addr = (uint32_t)phys_addr;
-    uint32_t frame = addr / _KMM_BLOCK_SIZE;
-    
-    if(frame >= total_frames || frame < 256){
-        return;
+    for(uint32_t i = 0; i < count; i++){
+        kmm_frame_put((void*)((uintptr_t)phys_addr + i * _KMM_BLOCK_SIZE));
     }
-    
-    if(!isframe_used(frame)){
-        return;  //frame wasn't allocated
+}
+
+//free blocks of one order in one zone (KMM_ZONE_DMA, _NORMAL or _HIGHMEM)
+uint32_t kmm_get_free_blocks(uint32_t zone, uint32_t order){
+    if(zone >= KMM_ZONE_COUNT || order > KMM_MAX_ORDER){
+        return 0;
     }
-    
-    //free
-    unmark_frame(frame);
-    used_frames--;
+    return zones[zone].free_blocks[order];
 }
 
 uint32_t kmm_get_total_frames(void){
     return total_frames;
 }
 
+//frames below LOWMEM_LIMIT, the ones with a permanent kernel mapping
+uint32_t kmm_get_lowmem_frames(void){
+    return lowmem_frames;
+}
+
+//frames sitting in magazines are free, even though the buddy lists count them as used
 uint32_t kmm_get_used_frames(void){
-    return used_frames;
-}
\ No newline at end of file
+    uint32_t cached = 0;
+    for(uint32_t cpu = 0; cpu < KMM_MAX_CPUS; cpu++){
+        cached += magazines[cpu].count;
+    }
+    return used_frames - cached;
+}
@@ -0,0 +1,235 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <mm/pagecache.h>
+#include <mm/vmm.h>
+#include <mm/kmm.h>
+#include <mm/kheap.h>
+#include <fs/hfs.h>
+#include <mem.h>
+
+#define PAGECACHE_BUCKETS 256
+
+//a mapped file, shared by every vma over it
+struct pc_file{
+    vfs* fsys;
+    uint32_t file_id;         //inode number
+    uint32_t users;
+    struct pc_file* next;
+};
+
+//one cached page, the cache holds a frame reference and every mapping another
+typedef struct pc_page{
+    pc_file_t* file;
+    uint32_t index;           //page index within the file
+    uint32_t frame;           //physical address
+    bool dirty;
+    struct pc_page* next;
+} pc_page_t;
+
+static pc_page_t* page_buckets[PAGECACHE_BUCKETS];
+static pc_file_t* file_list = NULL;
+static uint32_t pagecache_hits = 0;
+static uint32_t pagecache_misses = 0;
+
+//helpers
+static inline uint32_t pc_bucket(pc_file_t* file, uint32_t index){
+    return (((uint32_t)(uintptr_t)file >> 4) ^ (index * 31)) % PAGECACHE_BUCKETS;
+}
+
+static pc_page_t* pc_lookup(pc_file_t* file, uint32_t index){
+    for(pc_page_t* page = page_buckets[pc_bucket(file, index)]; page; page = page->next){
+        if(page->file == file && page->index == index){
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static void pc_writeback(pc_page_t* page){
+    if(!page->dirty){
+        return;
+    }
+    pc_file_t* file = page->file;
+    hfs_writepage(file->fsys, file->file_id, page->index * VMM_PAGE_SIZE, PHYS_TO_VIRT((void*)(uintptr_t)page->frame), VMM_PAGE_SIZE);
+    page->dirty = false;
+}
+
+static pc_file_t* pc_find_file(vfs* fsys, uint32_t file_id){
+    for(pc_file_t* file = file_list; file; file = file->next){
+        if(file->fsys == fsys && file->file_id == file_id){
+            return file;
+        }
+    }
+    return NULL;
+}
+
+//shared handle for the file behind node, NULL if it cannot be mapped
+pc_file_t* pagecache_open(vnode* node){
+    int32_t file_id = hfs_file_id(node);
+    if(file_id < 0 || !node->vfs_ptr){
+        return NULL;
+    }
+    pc_file_t* file = pc_find_file(node->vfs_ptr, (uint32_t)file_id);
+    if(file){
+        file->users++;
+        return file;
+    }
+
+    file = kmalloc(get_kernel_heap(), sizeof(pc_file_t));
+    if(!file){
+        return NULL;
+    }
+    file->fsys = node->vfs_ptr;
+    file->file_id = (uint32_t)file_id;
+    file->users = 1;
+    file->next = file_list;
+    file_list = file;
+    return file;
+}
+
+//another mapping of an open file, fork and vma splits
+void pagecache_dup(pc_file_t* file){
+    if(file){
+        file->users++;
+    }
+}
+
+//write back the dirty pages of a file
+void pagecache_sync(pc_file_t* file){
+    for(uint32_t bucket = 0; bucket < PAGECACHE_BUCKETS; bucket++){
+        for(pc_page_t* page = page_buckets[bucket]; page; page = page->next){
+            if(page->file == file){
+                pc_writeback(page);
+            }
+        }
+    }
+}
+
+//drop a mapping, the last one writes the file back and empties its pages
+void pagecache_close(pc_file_t* file){
+    if(!file || --file->users > 0){
+        return;
+    }
+    heap_t* heap = get_kernel_heap();
+    for(uint32_t bucket = 0; bucket < PAGECACHE_BUCKETS; bucket++){
+        pc_page_t** prev = &page_buckets[bucket];
+        while(*prev){
+            pc_page_t* page = *prev;
+            if(page->file != file){
+                prev = &page->next;
+                continue;
+            }
+            pc_writeback(page);
+            *prev = page->next;
+            kmm_frame_put((void*)(uintptr_t)page->frame);
+            kfree(heap, page);
+        }
+    }
+
+    pc_file_t** prev = &file_list;
+    while(*prev && *prev != file){
+        prev = &(*prev)->next;
+    }
+    if(*prev){
+        *prev = file->next;
+    }
+    kfree(heap, file);
+}
+
+//frame holding page index of the file, read in on a miss
+//the caller gets its own reference for the mapping, NULL on failure
+void* pagecache_get_page(pc_file_t* file, uint32_t index){
+    if(!file){
+        return NULL;
+    }
+    pc_page_t* page = pc_lookup(file, index);
+    if(page){
+        pagecache_hits++;
+        kmm_frame_get((void*)(uintptr_t)page->frame);
+        return (void*)(uintptr_t)page->frame;
+    }
+    pagecache_misses++;
+
+    void* frame = kmm_frame_alloc();
+    if(!frame){
+        return NULL;
+    }
+    if(hfs_readpage(file->fsys, file->file_id, index * VMM_PAGE_SIZE, PHYS_TO_VIRT(frame), VMM_PAGE_SIZE) < 0){
+        kmm_frame_put(frame);
+        return NULL;
+    }
+    page = kmalloc(get_kernel_heap(), sizeof(pc_page_t));
+    if(!page){
+        kmm_frame_put(frame);
+        return NULL;
+    }
+    page->file = file;
+    page->index = index;
+    page->frame = (uint32_t)(uintptr_t)frame;
+    page->dirty = false;
+    uint32_t bucket = pc_bucket(file, index);
+    page->next = page_buckets[bucket];
+    page_buckets[bucket] = page;
+
+    kmm_frame_get(frame);  //one for the cache, one for the mapping
+    return frame;
+}
+
+//a shared mapping wrote to the page, it goes back to the file on sync or close
+void pagecache_mark_dirty(pc_file_t* file, uint32_t index){
+    pc_page_t* page = pc_lookup(file, index);
+    if(page){
+        page->dirty = true;
+    }
+}
+
+//walk the cached pages over [offset, offset + size) of a file, to_cache
+//copies buf into them, otherwise they are copied out over buf
+static void pc_copy(vfs* fsys, uint32_t file_id, uint32_t offset, uint8_t* buf, uint32_t size, bool to_cache){
+    pc_file_t* file = pc_find_file(fsys, file_id);
+    if(!file){
+        return;
+    }
+    uint32_t done = 0;
+    while(done < size){
+        uint32_t index = (offset + done) / VMM_PAGE_SIZE;
+        uint32_t page_offset = (offset + done) % VMM_PAGE_SIZE;
+        uint32_t chunk = VMM_PAGE_SIZE - page_offset;
+        if(chunk > size - done){
+            chunk = size - done;
+        }
+        pc_page_t* page = pc_lookup(file, index);
+        if(page){
+            uint8_t* data = (uint8_t*)PHYS_TO_VIRT((void*)(uintptr_t)page->frame) + page_offset;
+            if(to_cache){
+                memcpy(data, buf + done, chunk);
+            }
+            else{
+                memcpy(buf + done, data, chunk);
+            }
+        }
+        done += chunk;
+    }
+}
+
+//read() result for the range, cached pages win since shared mappings store
+//into them directly and only reach the disk on sync
+void pagecache_read(vfs* fsys, uint32_t file_id, uint32_t offset, void* buf, uint32_t size){
+    pc_copy(fsys, file_id, offset, (uint8_t*)buf, size, false);
+}
+
+//write() went to disk, the cached copies follow so mappings see it and a
+//later writeback does not put the old bytes back
+void pagecache_write(vfs* fsys, uint32_t file_id, uint32_t offset, const void* buf, uint32_t size){
+    pc_copy(fsys, file_id, offset, (uint8_t*)buf, size, true);
+}
+
+uint32_t pagecache_get_hits(void){
+    return pagecache_hits;
+}
+
+uint32_t pagecache_get_misses(void){
+    return pagecache_misses;
+}
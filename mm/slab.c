@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <mm/slab.h>
+#include <mm/kmm.h>
+#include <mm/kheap.h>
+#include <mm/vmm.h>
+#include <mem.h>
+#include <interrupts.h>
+
+#define SLAB_SIZE VMM_PAGE_SIZE
+#define SLAB_MIN_ALIGN sizeof(void*)  //free objects hold the next pointer
+
+//one page of objects, the header sits at the start so any object finds its
+//slab by rounding down
+typedef struct slab{
+    kmem_cache_t* cache;
+    struct slab* next;
+    struct slab* prev;
+    void* free;               //free objects, linked through their first word
+    uint32_t in_use;
+} slab_t;
+
+struct kmem_cache{
+    char name[KMEM_CACHE_NAME_LEN];
+    size_t size;              //object stride, aligned
+    uint32_t per_slab;
+    uintptr_t first_offset;   //first object past the slab header
+    kmem_ctor_fn ctor;
+    slab_t* partial;          //slabs with free objects
+    slab_t* full;
+    slab_t* empty;            //one spare slab kept, the rest go back to kmm
+    uint32_t slabs;
+    uint32_t in_use;
+    uint32_t allocs;
+    uint32_t frees;
+    struct kmem_cache* next;
+};
+
+static kmem_cache_t* cache_list = NULL;
+
+//helpers
+static void slab_list_push(slab_t** head, slab_t* slab){
+    slab->prev = NULL;
+    slab->next = *head;
+    if(*head){
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(slab_t** head, slab_t* slab){
+    if(slab->prev){
+        slab->prev->next = slab->next;
+    }
+    else{
+        *head = slab->next;
+    }
+    if(slab->next){
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+//a fresh page cut into constructed objects
+static slab_t* slab_create(kmem_cache_t* cache){
+    void* frame = kmm_frame_alloc();
+    if(!frame){
+        return NULL;
+    }
+    slab_t* slab = (slab_t*)PHYS_TO_VIRT(frame);
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free = NULL;
+    slab->in_use = 0;
+
+    //push in reverse so objects come out in address order
+    for(uint32_t i = cache->per_slab; i > 0; i--){
+        void* obj = (void*)((uintptr_t)slab + cache->first_offset + (i - 1) * cache->size);
+        if(cache->ctor){
+            cache->ctor(obj);
+        }
+        *(void**)obj = slab->free;
+        slab->free = obj;
+    }
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, slab_t* slab){
+    cache->slabs--;
+    kmm_frame_free(VIRT_TO_PHYS(slab));
+}
+
+//cache of objects of one size, ctor (may be NULL) runs once per object when
+//its slab is made, so freed objects must be handed back in constructed state
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_fn ctor){
+    if(size == 0){
+        return NULL;
+    }
+    if(align < SLAB_MIN_ALIGN){
+        align = SLAB_MIN_ALIGN;
+    }
+    if(align & (align - 1)){
+        return NULL;
+    }
+    size_t stride = (size + align - 1) & ~(align - 1);
+    uintptr_t first_offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+    if(first_offset + stride > SLAB_SIZE){
+        return NULL;  //larger objects belong in kmalloc
+    }
+
+    kmem_cache_t* cache = kmalloc(get_kernel_heap(), sizeof(kmem_cache_t));
+    if(!cache){
+        return NULL;
+    }
+    memset(cache, 0, sizeof(kmem_cache_t));
+    if(name){
+        strncpy(cache->name, name, sizeof(cache->name) - 1);
+    }
+    cache->size = stride;
+    cache->first_offset = first_offset;
+    cache->per_slab = (SLAB_SIZE - first_offset) / stride;
+    cache->ctor = ctor;
+
+    uint32_t eflags = irq_save();
+    cache->next = cache_list;
+    cache_list = cache;
+    irq_restore(eflags);
+    return cache;
+}
+
+//every object must have been freed
+void kmem_cache_destroy(kmem_cache_t* cache){
+    if(!cache || cache->in_use > 0){
+        return;
+    }
+    uint32_t eflags = irq_save();
+    kmem_cache_t** prev = &cache_list;
+    while(*prev && *prev != cache){
+        prev = &(*prev)->next;
+    }
+    if(*prev){
+        *prev = cache->next;
+    }
+    while(cache->partial){
+        slab_t* slab = cache->partial;
+        slab_list_remove(&cache->partial, slab);
+        slab_destroy(cache, slab);
+    }
+    if(cache->empty){
+        slab_destroy(cache, cache->empty);
+    }
+    irq_restore(eflags);
+    kfree(get_kernel_heap(), cache);
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache){
+    if(!cache){
+        return NULL;
+    }
+    uint32_t eflags = irq_save();
+    slab_t* slab = cache->partial;
+    if(!slab){
+        slab = cache->empty;
+        cache->empty = NULL;
+        if(!slab){
+            slab = slab_create(cache);
+        }
+        if(!slab){
+            irq_restore(eflags);
+            return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void* obj = slab->free;
+    slab->free = *(void**)obj;
+    slab->in_use++;
+    if(!slab->free){
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    cache->in_use++;
+    cache->allocs++;
+    irq_restore(eflags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj){
+    if(!cache || !obj){
+        return;
+    }
+    slab_t* slab = (slab_t*)((uintptr_t)obj & ~(SLAB_SIZE - 1));
+    if(slab->cache != cache){
+        return;  //not one of ours
+    }
+    uint32_t eflags = irq_save();
+    if(!slab->free){
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    slab->in_use--;
+    cache->in_use--;
+    cache->frees++;
+
+    //keep one empty slab around for the next burst, free the others
+    if(slab->in_use == 0){
+        slab_list_remove(&cache->partial, slab);
+        if(!cache->empty){
+            cache->empty = slab;
+        }
+        else{
+            slab_destroy(cache, slab);
+        }
+    }
+    irq_restore(eflags);
+}
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats){
+    if(!cache || !stats){
+        return;
+    }
+    stats->object_size = cache->size;
+    stats->objects_in_use = cache->in_use;
+    stats->objects_total = cache->slabs * cache->per_slab;
+    stats->slabs = cache->slabs;
+    stats->allocs = cache->allocs;
+    stats->frees = cache->frees;
+}
+
+//walk every cache, for stats dumps
+kmem_cache_t* kmem_cache_first(void){
+    return cache_list;
+}
+
+kmem_cache_t* kmem_cache_next(kmem_cache_t* cache){
+    return cache ? cache->next : NULL;
+}
+
+const char* kmem_cache_name(kmem_cache_t* cache){
+    return cache ? cache->name : NULL;
+}
@@ -0,0 +1,504 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <mm/vma.h>
+#include <mm/vmm.h>
+#include <mm/kmm.h>
+#include <mm/kheap.h>
+#include <mm/pagecache.h>
+#include <mem.h>
+
+#define VMA_MAX_PER_SPACE 64
+#define USER_SPACE_END 0xC0000000
+#define VMA_MMAP_BASE 0x40000000      //first address mmap hands out without a hint
+#define VMA_NO_CACHE 0xFFFFFFFF
+#define PAGE_ALIGN_DOWN(x) ((uintptr_t)(x) & ~(VMM_PAGE_SIZE - 1))
+#define PAGE_ALIGN_UP(x) (((uintptr_t)(x) + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1))
+#define VMA_HUGE_SIZE (VMM_PAGES_PER_TABLE * VMM_PAGE_SIZE)  //what one pde maps, 4MB or 2MB with pae
+
+//one mapped range, pages are populated on first touch unless the owner
+//backed them already
+typedef struct{
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t flags;           //pte flags for its pages
+    uint32_t kind;            //VMA_ANON, VMA_STACK, VMA_HEAP, VMA_ELF or VMA_FILE
+    pc_file_t* file;          //VMA_FILE only, pages come from the page cache
+    uint32_t pgoff;           //file page mapped at start
+    bool shared;              //writes go back to the file
+} vma_t;
+
+//every range of one address space, sorted by start and never overlapping
+struct vm_space{
+    pagedir_t* pdir;
+    uint32_t count;
+    uint32_t cache;           //index of the last lookup hit
+    uintptr_t brk_start;      //end of the program image, heap grows from here
+    uintptr_t brk;
+    vma_t vmas[VMA_MAX_PER_SPACE];
+};
+
+//kernel reservations, the heap among them, so no kmalloc for this one
+static vm_space_t kernel_space;
+
+//helpers
+//first vma ending above addr, count if none
+static uint32_t vma_lower_bound(vm_space_t* space, uintptr_t addr){
+    uint32_t low = 0, high = space->count;
+    while(low < high){
+        uint32_t mid = (low + high) / 2;
+        if(space->vmas[mid].end <= addr){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static vma_t* vma_find(vm_space_t* space, uintptr_t addr){
+    if(space->cache < space->count){
+        vma_t* cached = &space->vmas[space->cache];
+        if(addr >= cached->start && addr < cached->end){
+            return cached;
+        }
+    }
+    uint32_t idx = vma_lower_bound(space, addr);
+    if(idx < space->count && space->vmas[idx].start <= addr){
+        space->cache = idx;
+        return &space->vmas[idx];
+    }
+    return NULL;
+}
+
+static bool vma_range_free(vm_space_t* space, uintptr_t start, uintptr_t end){
+    uint32_t idx = vma_lower_bound(space, start);
+    return idx >= space->count || space->vmas[idx].start >= end;
+}
+
+//copy vma into a slot opened at idx, the array stays sorted
+static bool vma_insert_at(vm_space_t* space, uint32_t idx, const vma_t* vma){
+    if(space->count == VMA_MAX_PER_SPACE){
+        return false;
+    }
+    for(uint32_t i = space->count; i > idx; i--){
+        space->vmas[i] = space->vmas[i - 1];
+    }
+    space->vmas[idx] = *vma;
+    space->count++;
+    space->cache = VMA_NO_CACHE;
+    return true;
+}
+
+static void vma_remove_at(vm_space_t* space, uint32_t idx){
+    for(uint32_t i = idx; i + 1 < space->count; i++){
+        space->vmas[i] = space->vmas[i + 1];
+    }
+    space->count--;
+    space->cache = VMA_NO_CACHE;
+}
+
+//make addr a vma boundary, splitting the vma that straddles it
+static bool vma_split(vm_space_t* space, uintptr_t addr){
+    uint32_t idx = vma_lower_bound(space, addr);
+    if(idx >= space->count || space->vmas[idx].start >= addr){
+        return true;
+    }
+    vma_t upper = space->vmas[idx];
+    upper.start = addr;
+    if(upper.file){
+        upper.pgoff += (addr - space->vmas[idx].start) / VMM_PAGE_SIZE;
+    }
+    if(!vma_insert_at(space, idx + 1, &upper)){
+        return false;
+    }
+    pagecache_dup(upper.file);
+    space->vmas[idx].end = addr;
+    return true;
+}
+
+//pass the dirty pages of a shared file mapping on to the page cache
+static void vma_collect_dirty(vm_space_t* space, vma_t* vma){
+    if(!vma->file || !vma->shared){
+        return;
+    }
+    for(uintptr_t virt_addr = vma->start; virt_addr < vma->end; virt_addr += VMM_PAGE_SIZE){
+        if(vmm_page_dirty(space->pdir, (void*)virt_addr)){
+            pagecache_mark_dirty(vma->file, vma->pgoff + (virt_addr - vma->start) / VMM_PAGE_SIZE);
+        }
+    }
+}
+
+//unmap the pages of a vma and let go of its file
+static void vma_release(vm_space_t* space, vma_t* vma){
+    vma_collect_dirty(space, vma);
+    vmm_free_region(space->pdir, (void*)vma->start, vma->end - vma->start);
+    if(vma->file){
+        pagecache_close(vma->file);
+        vma->file = NULL;
+    }
+}
+
+static inline bool vma_user_range(vm_space_t* space, uintptr_t start, uintptr_t end){
+    return space == &kernel_space || (start < end && end <= USER_SPACE_END);
+}
+
+// SPACES
+//address space bookkeeping for a directory, found again through its frame
+vm_space_t* vma_space_create(pagedir_t* pdir){
+    if(!pdir){
+        return NULL;
+    }
+    vm_space_t* space = kmalloc(get_kernel_heap(), sizeof(vm_space_t));
+    if(!space){
+        return NULL;
+    }
+    memset(space, 0, sizeof(vm_space_t));
+    space->pdir = pdir;
+    space->cache = VMA_NO_CACHE;
+    kmm_frame_set_private(VIRT_TO_PHYS(pdir), (uint32_t)(uintptr_t)space);
+    return space;
+}
+
+//forget every range, populated anonymous pages are left to the page tables
+void vma_space_destroy(vm_space_t* space){
+    if(!space || space == &kernel_space){
+        return;
+    }
+    for(uint32_t idx = 0; idx < space->count; idx++){
+        if(space->vmas[idx].file){
+            vma_release(space, &space->vmas[idx]);
+        }
+    }
+    kmm_frame_set_private(VIRT_TO_PHYS(space->pdir), 0);
+    kfree(get_kernel_heap(), space);
+}
+
+vm_space_t* vma_space_of(pagedir_t* pdir){
+    if(!pdir){
+        return NULL;
+    }
+    if(pdir == vmm_get_kerneldir()){
+        kernel_space.pdir = pdir;
+        return &kernel_space;
+    }
+    return (vm_space_t*)(uintptr_t)kmm_frame_get_private(VIRT_TO_PHYS(pdir));
+}
+
+//fork, same ranges over the cloned directory
+vm_space_t* vma_space_clone(vm_space_t* src, pagedir_t* pdir){
+    if(!src){
+        return NULL;
+    }
+    vm_space_t* space = vma_space_create(pdir);
+    if(!space){
+        return NULL;
+    }
+    space->count = src->count;
+    space->brk_start = src->brk_start;
+    space->brk = src->brk;
+    memcpy(space->vmas, src->vmas, src->count * sizeof(vma_t));
+    
+    for(uint32_t idx = 0; idx < space->count; idx++){
+        vma_t* vma = &space->vmas[idx];
+        pagecache_dup(vma->file);
+        //the clone made shared file pages copy-on-write, drop them on both
+        //sides so they fault back in from the cache still shared
+        if(vma->file && vma->shared){
+            vma_collect_dirty(src, &src->vmas[idx]);
+            vmm_free_region(src->pdir, (void*)vma->start, vma->end - vma->start);
+            vmm_free_region(pdir, (void*)vma->start, vma->end - vma->start);
+        }
+    }
+    return space;
+}
+
+// RANGES
+//record a range, it must not overlap an existing one
+bool vma_insert(vm_space_t* space, uintptr_t start, size_t size, uint32_t flags, uint32_t kind){
+    if(!space || size == 0){
+        return false;
+    }
+    uintptr_t region_start = PAGE_ALIGN_DOWN(start);
+    uintptr_t region_end = PAGE_ALIGN_UP(start + size);
+    if(!vma_user_range(space, region_start, region_end) || !vma_range_free(space, region_start, region_end)){
+        return false;
+    }
+    vma_t vma = {
+        .start = region_start,
+        .end = region_end,
+        .flags = flags | PTE_PRESENT,
+        .kind = kind,
+        .file = NULL,
+        .pgoff = 0,
+        .shared = false
+    };
+    if(!vma_insert_at(space, vma_lower_bound(space, region_start), &vma)){
+        return false;
+    }
+    //the program break starts past the image
+    if(kind == VMA_ELF && region_end > space->brk_start){
+        space->brk_start = region_end;
+        space->brk = region_end;
+    }
+    return true;
+}
+
+//flags of the range holding addr, false when nothing covers it
+bool vma_get_flags(vm_space_t* space, uintptr_t addr, uint32_t* flags){
+    vma_t* vma = space ? vma_find(space, addr) : NULL;
+    if(!vma){
+        return false;
+    }
+    *flags = vma->flags;
+    return true;
+}
+
+//drop the ranges inside [start, start + size) and free their pages
+bool vma_remove(vm_space_t* space, uintptr_t start, size_t size){
+    if(!space || size == 0){
+        return false;
+    }
+    uintptr_t region_start = PAGE_ALIGN_DOWN(start);
+    uintptr_t region_end = PAGE_ALIGN_UP(start + size);
+    if(!vma_user_range(space, region_start, region_end)){
+        return false;
+    }
+    if(!vma_split(space, region_start) || !vma_split(space, region_end)){
+        return false;
+    }
+    uint32_t idx = vma_lower_bound(space, region_start);
+    while(idx < space->count && space->vmas[idx].start < region_end){
+        vma_release(space, &space->vmas[idx]);
+        vma_remove_at(space, idx);
+    }
+    return true;
+}
+
+//new page flags for the ranges inside [start, start + size)
+bool vma_protect(vm_space_t* space, uintptr_t start, size_t size, uint32_t flags){
+    if(!space || size == 0){
+        return false;
+    }
+    uintptr_t region_start = PAGE_ALIGN_DOWN(start);
+    uintptr_t region_end = PAGE_ALIGN_UP(start + size);
+    if(!vma_user_range(space, region_start, region_end)){
+        return false;
+    }
+    if(!vma_split(space, region_start) || !vma_split(space, region_end)){
+        return false;
+    }
+    for(uint32_t idx = vma_lower_bound(space, region_start); idx < space->count && space->vmas[idx].start < region_end; idx++){
+        vma_t* vma = &space->vmas[idx];
+        vma->flags = flags | PTE_PRESENT;
+        uint32_t page_flags = vma->flags;
+        //private file pages may still be the cache's, writes must copy first
+        if(vma->file && !vma->shared && (page_flags & PTE_WRITABLE)){
+            page_flags = (page_flags & ~PTE_WRITABLE) | PTE_COW;
+        }
+        vmm_protect_range(space->pdir, (void*)vma->start, vma->end - vma->start, page_flags);
+    }
+    return true;
+}
+
+//where a new range of size bytes goes, at hint if that is free, otherwise in
+//the first gap above VMA_MMAP_BASE, 0 when nothing fits
+static uintptr_t vma_place(vm_space_t* space, uintptr_t hint, size_t size){
+    hint = PAGE_ALIGN_DOWN(hint);
+    if(hint && hint + size > hint && vma_user_range(space, hint, hint + size) && vma_range_free(space, hint, hint + size)){
+        return hint;
+    }
+
+    uintptr_t candidate = VMA_MMAP_BASE;
+    for(uint32_t idx = vma_lower_bound(space, candidate); idx < space->count; idx++){
+        if(space->vmas[idx].start >= candidate + size){
+            break;
+        }
+        candidate = space->vmas[idx].end;
+    }
+    if(candidate + size < candidate || !vma_user_range(space, candidate, candidate + size)){
+        return 0;
+    }
+    return candidate;
+}
+
+//anonymous zero-filled range, returns its address or 0
+uintptr_t vma_map(vm_space_t* space, uintptr_t hint, size_t size, uint32_t flags){
+    if(!space || size == 0){
+        return 0;
+    }
+    size = PAGE_ALIGN_UP(size);
+    uintptr_t addr = vma_place(space, hint, size);
+    if(!addr || !vma_insert(space, addr, size, flags, VMA_ANON)){
+        return 0;
+    }
+    return addr;
+}
+
+//map size bytes of the file behind node from offset, pages are served from the
+//page cache so every mapper shares one copy, shared mappings write back to the file
+uintptr_t vma_map_file(vm_space_t* space, uintptr_t hint, size_t size, uint32_t flags, vnode* node, uint32_t offset, bool shared){
+    if(!space || size == 0 || (offset & (VMM_PAGE_SIZE - 1)) != 0){
+        return 0;
+    }
+    size = PAGE_ALIGN_UP(size);
+    uintptr_t addr = vma_place(space, hint, size);
+    if(!addr){
+        return 0;
+    }
+    pc_file_t* file = pagecache_open(node);
+    if(!file){
+        return 0;
+    }
+    if(!vma_insert(space, addr, size, flags, VMA_FILE)){
+        pagecache_close(file);
+        return 0;
+    }
+    vma_t* vma = vma_find(space, addr);
+    vma->file = file;
+    vma->pgoff = offset / VMM_PAGE_SIZE;
+    vma->shared = shared;
+    return addr;
+}
+
+//write back what the shared file mappings in the range changed so far
+bool vma_sync(vm_space_t* space, uintptr_t start, size_t size){
+    if(!space || size == 0){
+        return false;
+    }
+    uintptr_t region_end = PAGE_ALIGN_UP(start + size);
+    for(uint32_t idx = vma_lower_bound(space, PAGE_ALIGN_DOWN(start)); idx < space->count && space->vmas[idx].start < region_end; idx++){
+        vma_t* vma = &space->vmas[idx];
+        if(vma->file && vma->shared){
+            vma_collect_dirty(space, vma);
+            vmm_clean_range(space->pdir, (void*)vma->start, vma->end - vma->start);
+            pagecache_sync(vma->file);
+        }
+    }
+    return true;
+}
+
+//move the program break, returns the break in effect afterwards
+uintptr_t vma_brk(vm_space_t* space, uintptr_t new_brk){
+    if(!space || space->brk_start == 0 || new_brk < space->brk_start){
+        return space ? space->brk : 0;
+    }
+    uintptr_t old_end = PAGE_ALIGN_UP(space->brk);
+    uintptr_t new_end = PAGE_ALIGN_UP(new_brk);
+
+    if(new_end > old_end){
+        if(!vma_user_range(space, old_end, new_end) || !vma_range_free(space, old_end, new_end)){
+            return space->brk;
+        }
+        //grow the heap range in place when it ends at the old break
+        uint32_t idx = vma_lower_bound(space, old_end - 1);
+        vma_t* heap = (idx < space->count) ? &space->vmas[idx] : NULL;
+        if(heap && heap->kind == VMA_HEAP && heap->end == old_end){
+            heap->end = new_end;
+        }
+        else if(!vma_insert(space, old_end, new_end - old_end, PTE_WRITABLE | PTE_USER | PTE_NOEXEC, VMA_HEAP)){
+            return space->brk;
+        }
+    }
+    else if(new_end < old_end){
+        vma_remove(space, new_end, old_end - new_end);
+    }
+    space->brk = new_brk;
+    return space->brk;
+}
+
+//whether addr lies in a range that may be written, checked before a
+//copy-on-write page is made writable, directories without ranges keep the
+//page flags as the only record
+bool vma_writable(pagedir_t* pdir, uintptr_t addr){
+    vm_space_t* space = vma_space_of(pdir);
+    if(!space){
+        return true;
+    }
+    vma_t* vma = vma_find(space, addr);
+    return vma && (vma->flags & PTE_WRITABLE);
+}
+
+// FAULTS
+//back a not-present page inside a range of the faulting space, kernel
+//ranges like the heap are tried after the current directory's own
+bool vma_handle_fault(pagedir_t* pdir, uintptr_t fault_address, bool from_user, bool write){
+    pagedir_t* kernel_dir = vmm_get_kerneldir();
+    vm_space_t* space = vma_space_of(pdir);
+    vma_t* vma = space ? vma_find(space, fault_address) : NULL;
+    if(!vma && pdir != kernel_dir){
+        space = vma_space_of(kernel_dir);
+        vma = vma_find(space, fault_address);
+    }
+    if(!vma || (from_user && !(vma->flags & PTE_USER))){
+        return false;
+    }
+
+    uintptr_t page = PAGE_ALIGN_DOWN(fault_address);
+    if(!vmm_get_pfn(space->pdir, (void*)page)){
+        uint32_t pfn;
+        uint32_t page_flags = vma->flags;
+        uintptr_t huge_base = page & ~(VMA_HUGE_SIZE - 1);
+        if(vma->file){
+            void* frame = pagecache_get_page(vma->file, vma->pgoff + (page - vma->start) / VMM_PAGE_SIZE);
+            pfn = (uintptr_t)frame / VMM_PAGE_SIZE;
+            //private writers get their own copy on the first write
+            if(!vma->shared && (page_flags & PTE_WRITABLE)){
+                page_flags = (page_flags & ~PTE_WRITABLE) | PTE_COW;
+            }
+        }
+        else if(space == &kernel_space){
+            pfn = (uintptr_t)kmm_frame_alloc_zeroed() / VMM_PAGE_SIZE;
+        }
+        else if(!write){
+            //reads see zeros without costing a frame, a write copies later
+            if(!vmm_map_zero_page(space->pdir, (void*)page, page_flags)){
+                return false;
+            }
+            asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+            return true;
+        }
+        else if(huge_base >= vma->start && huge_base + VMA_HUGE_SIZE <= vma->end && vmm_alloc_large(space->pdir, (void*)huge_base, page_flags)){
+            //anonymous range covers the whole aligned large page, one pde backs it
+            asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+            return true;
+        }
+        else{
+            //user memory is only touched through user mappings, keep lowmem
+            //for the kernel and zero the page through the kmap window
+            pfn = kmm_highmem_alloc();
+            void* mapped = pfn ? vmm_kmap(pfn) : NULL;
+            if(mapped){
+                memset(mapped, 0, VMM_PAGE_SIZE);
+                vmm_kunmap(mapped);
+            }
+            else if(pfn){
+                kmm_pfn_put(pfn);
+                pfn = 0;
+            }
+        }
+        if(!pfn){
+            return false;
+        }
+        vmm_map_pfn(space->pdir, (void*)page, pfn, page_flags);
+        if(vmm_get_pfn(space->pdir, (void*)page) != pfn){
+            kmm_pfn_put(pfn);  //no page table for it
+            return false;
+        }
+        //cache frames are shared, never moved behind the cache's back
+        if(space != &kernel_space && !vma->file && pfn < kmm_get_lowmem_frames()){
+            kmm_frame_mark_movable((void*)(pfn * VMM_PAGE_SIZE));
+        }
+    }
+
+    //kernel half tables are in every directory already, only a kernel
+    //range below it can be missing here
+    uint32_t pd_index = VMM_DIR_INDEX(page);
+    if(space == &kernel_space && pdir != kernel_dir && !PDE_IS_PRESENT(pdir->table[pd_index])){
+        pdir->table[pd_index] = kernel_dir->table[pd_index];
+    }
+    asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+    return true;
+}
@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <mm/kmm.h>
+
+#define VMALLOC_START 0xF8800000      //past the largest physmap, with a gap
+#define VMALLOC_END 0xFFC00000        //kmap window starts here
+#define VMALLOC_MAX_AREAS 256
+#define PAGE_ALIGN_UP(x) (((uintptr_t)(x) + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1))
+
+//one allocation, an unmapped guard page follows it
+typedef struct{
+    uintptr_t start;
+    uint32_t pages;
+} vm_area_t;
+
+//live areas sorted by start
+static vm_area_t areas[VMALLOC_MAX_AREAS];
+static uint32_t area_count = 0;
+static uint32_t vmalloc_pages = 0;
+
+//helpers
+static inline uintptr_t area_end(vm_area_t* area){
+    return area->start + (area->pages + 1) * VMM_PAGE_SIZE;  //guard included
+}
+
+static int32_t area_index(uintptr_t addr){
+    uint32_t low = 0, high = area_count;
+    while(low < high){
+        uint32_t mid = (low + high) / 2;
+        if(areas[mid].start < addr){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return (low < area_count && areas[low].start == addr) ? (int32_t)low : -1;
+}
+
+//first gap that fits pages plus a guard, the slot it goes in through idx
+static uintptr_t area_place(uint32_t pages, uint32_t* idx){
+    uintptr_t size = (pages + 1) * VMM_PAGE_SIZE;
+    uintptr_t candidate = VMALLOC_START;
+    for(uint32_t i = 0; i < area_count; i++){
+        if(areas[i].start - candidate >= size){
+            *idx = i;
+            return candidate;
+        }
+        candidate = area_end(&areas[i]);
+    }
+    if(VMALLOC_END - candidate < size){
+        return 0;
+    }
+    *idx = area_count;
+    return candidate;
+}
+
+//virtually contiguous kernel memory from scattered frames, page granular
+//frames come from highmem first since nothing reaches them through the physmap
+void* vmalloc(size_t size){
+    if(size == 0 || size > VMALLOC_END - VMALLOC_START || area_count >= VMALLOC_MAX_AREAS){
+        return NULL;
+    }
+    uint32_t pages = PAGE_ALIGN_UP(size) / VMM_PAGE_SIZE;
+    uint32_t idx;
+    uintptr_t start = area_place(pages, &idx);
+    if(!start){
+        return NULL;
+    }
+
+    //kernel half tables come from the template, every directory sees these
+    pagedir_t* pdir = vmm_get_kerneldir();
+    for(uint32_t i = 0; i < pages; i++){
+        uint32_t pfn = kmm_highmem_alloc();
+        if(pfn == 0){
+            if(i > 0){
+                vmm_free_region(pdir, (void*)start, i * VMM_PAGE_SIZE);
+            }
+            return NULL;
+        }
+        vmm_map_pfn(pdir, (void*)(start + i * VMM_PAGE_SIZE), pfn, PTE_WRITABLE | PTE_NOEXEC);
+    }
+
+    for(uint32_t i = area_count; i > idx; i--){
+        areas[i] = areas[i - 1];
+    }
+    areas[idx].start = start;
+    areas[idx].pages = pages;
+    area_count++;
+    vmalloc_pages += pages;
+    return (void*)start;
+}
+
+void vfree(void* addr){
+    int32_t idx = area_index((uintptr_t)addr);
+    if(idx < 0){
+        return;
+    }
+    vm_area_t* area = &areas[idx];
+    vmm_free_region(vmm_get_kerneldir(), (void*)area->start, area->pages * VMM_PAGE_SIZE);
+    vmalloc_pages -= area->pages;
+
+    for(uint32_t i = (uint32_t)idx; i + 1 < area_count; i++){
+        areas[i] = areas[i + 1];
+    }
+    area_count--;
+}
+
+bool is_vmalloc_addr(const void* addr){
+    return (uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr < VMALLOC_END;
+}
+
+//usable bytes of the area starting at addr, 0 if there is none
+size_t vmalloc_size(const void* addr){
+    int32_t idx = area_index((uintptr_t)addr);
+    return idx < 0 ? 0 : areas[idx].pages * VMM_PAGE_SIZE;
+}
+
+uint32_t vmalloc_get_pages(void){
+    return vmalloc_pages;
+}
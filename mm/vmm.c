@@ -5,21 +5,225 @@
 #include <stdio.h>
 #include "../include/mm/vmm.h"
 #include "../include/mm/kmm.h"
+#include "../include/mm/vma.h"
 #include "../include/mem.h"
 #include "../include/utils.h"
 #include "../include/mm/kheap.h"
 #include "../include/interrupts.h"
 
+#define PTE_DIRTY 0x40        //set by the cpu on the first write through the pte
+#define PF_PRESENT 0x1        //page fault error code bits
+#define PF_WRITE 0x2
+#define PF_USER 0x4
+#define CR0_WP 0x10000        //supervisor writes honour read-only ptes
+#define CR4_PSE 0x10
+#define CR4_PGE 0x80
+#define PTE_GLOBAL 0x100          //survives cr3 reloads, also valid on large pdes
+#define KERNEL_SPACE_START 0xC0000000
+#define KERNEL_PDE_START VMM_DIR_INDEX(KERNEL_SPACE_START)  //first pde of the kernel half
+#define PDE_LARGE 0x80            //pde maps a large page directly
+#define VMM_LARGE_PAGE_SIZE (VMM_PAGES_PER_TABLE * VMM_PAGE_SIZE)  //one pde's worth, 4MB or 2MB with pae
+#define PDE_LARGE_FRAME_MASK (PDE_FRAME_MASK & ~(pde_t)(VMM_LARGE_PAGE_SIZE - 1))
+#define VMM_DIR_FRAMES (sizeof(pagedir_t) / VMM_PAGE_SIZE)  //4 with pae, one per pdpt entry
+#define CPUID_EDX_PSE (1 << 3)
+#define CPUID_EDX_PGE (1 << 13)
+#define CPUID_EXT_EDX_NX (1 << 20)    //leaf 0x80000001
+#define MSR_EFER 0xC0000080
+#define EFER_NXE 0x800
+#ifdef CONFIG_PAE
+#define PTE_NX (1ULL << 63)
+#define VMM_MAX_PDPTS 128             //live address spaces, each needs a pdpt below 4GB
+#define PAE_TRAMPOLINE_PHYS 0x7000    //identity mapped page the switch to pae runs from
+#else
+#define PTE_NX 0
+#endif
+#define KMAP_START 0xFFC00000         //window for frames the physmap does not reach
+#define KMAP_PAGES 256
+#define PDE_IS_LARGE(x) (((x) & PDE_LARGE) != 0)
+#define TLB_BATCH_MAX 64              //pages a batch remembers before giving up on invlpg
+#define TLB_FLUSH_THRESHOLD_DEFAULT 32
+
 static pagedir_t* kernel_directory = NULL;
 static pagedir_t* current_directory = NULL;
+//invalidations collected over one region operation, flushed once at the end
+typedef struct{
+    pagedir_t* pdir;
+    uint32_t count;
+    bool full_flush;          //past the threshold, reload everything instead
+    bool has_global;
+    uintptr_t pages[TLB_BATCH_MAX];
+} tlb_batch_t;
+
+static uint32_t tlb_flush_threshold = TLB_FLUSH_THRESHOLD_DEFAULT;
+static uint32_t tlb_page_flushes = 0;
+static uint32_t tlb_full_flushes = 0;
+static uint32_t huge_hits = 0;
+static uint32_t huge_fallbacks = 0;
+static uint32_t huge_splits = 0;
+static uint32_t zero_pfn = 0;             //shared by every untouched anonymous page
+static uint32_t zero_page_maps = 0;
+static bool pse_enabled = false;
+static bool pge_enabled = false;
+static bool nx_enabled = false;
+static uint64_t init_cycles = 0;
+static uint32_t kmap_used[KMAP_PAGES / 32];
+#ifdef CONFIG_PAE
+static uint64_t pdpt_pool[VMM_MAX_PDPTS][4] __attribute__((aligned(32)));
+static bool pdpt_used[VMM_MAX_PDPTS];
+#endif
+
+extern uint32_t kernel_start;
+extern uint32_t kernel_end;
+
+static inline uint64_t rdtsc(void){
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+//cpuid leaf 1 edx feature bit
+static bool cpu_has_feature(uint32_t edx_bit){
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx & edx_bit) != 0;
+}
+
+//no-execute needs pae and the extended feature leaf
+static bool cpu_has_nx(void){
+    uint32_t eax = 0x80000000, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if(eax < 0x80000001){
+        return false;
+    }
+    eax = 0x80000001;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx & CPUID_EXT_EDX_NX) != 0;
+}
 
 //helpers
+//PTE_NOEXEC is software only, it becomes the nx bit when the cpu has one
+static inline pte_t pte_encode_flags(uint32_t flags){
+    pte_t entry = flags & 0xFFF & ~PTE_NOEXEC;
+    if((flags & PTE_NOEXEC) && nx_enabled){
+        entry |= PTE_NX;
+    }
+    return entry;
+}
+
+//flags of an entry in the form the rest of the kernel passes around
+static inline uint32_t pte_flags(pte_t entry){
+    uint32_t flags = (uint32_t)(entry & 0xFFF);
+    if(entry & PTE_NX){
+        flags |= PTE_NOEXEC;
+    }
+    return flags;
+}
+
+static inline uint32_t pte_pfn(pte_t entry){
+    return (uint32_t)(PTE_FRAME_ADDR(entry) / VMM_PAGE_SIZE);
+}
+
 static inline pde_t pde_create(void* phys_addr, uint32_t flags){
-    return ((uint32_t)phys_addr & PDE_FRAME_MASK) | (flags & 0xFFF);
+    return ((uintptr_t)phys_addr & PDE_FRAME_MASK) | (flags & 0xFFF);
+}
+
+static inline pte_t pte_create_pfn(uint32_t pfn, uint32_t flags){
+    return (((pte_t)pfn * VMM_PAGE_SIZE) & PTE_FRAME_MASK) | pte_encode_flags(flags);
 }
 
 static inline pte_t pte_create(void* phys_addr, uint32_t flags){
-    return ((uint32_t)phys_addr & PTE_FRAME_MASK) | (flags & 0xFFF);
+    return pte_create_pfn((uintptr_t)phys_addr / VMM_PAGE_SIZE, flags);
+}
+
+//page tables always come from lowmem, the physmap reaches them
+static inline pagetable_t* pde_table(pde_t entry){
+    return (pagetable_t*)PHYS_TO_VIRT((void*)(uintptr_t)PDE_PTABLE_ADDR(entry));
+}
+
+//kernel half translations are shared by every process, keep them across switches
+static inline uint32_t vmm_global_flag(uintptr_t virt_addr){
+    return (pge_enabled && virt_addr >= KERNEL_SPACE_START) ? PTE_GLOBAL : 0;
+}
+
+static void tlb_batch_init(tlb_batch_t* batch, pagedir_t* pdir){
+    batch->pdir = pdir;
+    batch->count = 0;
+    batch->full_flush = false;
+    batch->has_global = false;
+}
+
+//remember a page whose pte was just changed, entries that were never present
+//cannot be cached and are not worth an invlpg
+static void tlb_batch_add(tlb_batch_t* batch, uintptr_t virt_addr, pte_t old_entry){
+    if(!PTE_IS_PRESENT(old_entry)){
+        return;
+    }
+    //user half of a directory that is not loaded has nothing in the tlb
+    if(virt_addr < KERNEL_SPACE_START && batch->pdir != current_directory){
+        return;
+    }
+    if(old_entry & PTE_GLOBAL){
+        batch->has_global = true;
+    }
+    if(batch->full_flush){
+        return;
+    }
+    if(batch->count >= tlb_flush_threshold){
+        batch->full_flush = true;
+        return;
+    }
+    batch->pages[batch->count++] = virt_addr & ~(VMM_PAGE_SIZE - 1);
+}
+
+//flush what the batch collected on this cpu
+//an smp kernel would send the same page list (or the full flush) to every
+//other cpu running batch->pdir here, and global ones to all of them
+static void tlb_batch_flush(tlb_batch_t* batch){
+    if(batch->full_flush){
+        if(batch->has_global){
+            //cr3 reloads keep global entries, toggling pge drops them too
+            uint32_t cr4;
+            asm volatile("mov %%cr4, %0" : "=r"(cr4));
+            asm volatile("mov %0, %%cr4" :: "r"(cr4 & ~CR4_PGE) : "memory");
+            asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+        }
+        else{
+            uint32_t cr3;
+            asm volatile("mov %%cr3, %0" : "=r"(cr3));
+            asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+        }
+        tlb_full_flushes++;
+    }
+    else{
+        for(uint32_t i = 0; i < batch->count; i++){
+            asm volatile("invlpg (%0)" :: "r"(batch->pages[i]) : "memory");
+        }
+        tlb_page_flushes += batch->count;
+    }
+    batch->count = 0;
+    batch->full_flush = false;
+    batch->has_global = false;
+}
+
+//the zero frame is never written, writable mappings of it copy on the first write
+static inline uint32_t zero_page_flags(uint32_t flags){
+    return (flags & PTE_WRITABLE) ? ((flags & ~PTE_WRITABLE) | PTE_COW) : flags;
+}
+
+//pages above which a region operation reloads cr3 instead of using invlpg
+void vmm_set_tlb_flush_threshold(uint32_t pages){
+    if(pages > TLB_BATCH_MAX){
+        pages = TLB_BATCH_MAX;
+    }
+    tlb_flush_threshold = pages;
+}
+
+uint32_t vmm_get_tlb_page_flushes(void){
+    return tlb_page_flushes;
+}
+
+uint32_t vmm_get_tlb_full_flushes(void){
+    return tlb_full_flushes;
 }
 
 pagedir_t* vmm_get_kerneldir(void){
@@ -30,16 +234,73 @@ pagedir_t* vmm_get_current_pagedir(void){
     return current_directory;
 }
 
+#ifdef CONFIG_PAE
+//the four directory frames hang off a pdpt, which cr3 points at instead
+//its pool slot is kept in the second directory frame
+static bool vmm_pdpt_attach(void* dir_phys){
+    for(uint32_t slot = 0; slot < VMM_MAX_PDPTS; slot++){
+        if(pdpt_used[slot]){
+            continue;
+        }
+        pdpt_used[slot] = true;
+        for(uint32_t i = 0; i < 4; i++){
+            pdpt_pool[slot][i] = ((uint64_t)(uintptr_t)dir_phys + i * VMM_PAGE_SIZE) | PDE_PRESENT;  //pdptes take no other flags
+        }
+        kmm_frame_set_private((void*)((uintptr_t)dir_phys + VMM_PAGE_SIZE), slot);
+        return true;
+    }
+    return false;
+}
+
+static uint32_t vmm_pdpt_slot(pagedir_t* dir){
+    return kmm_frame_get_private((void*)((uintptr_t)VIRT_TO_PHYS(dir) + VMM_PAGE_SIZE));
+}
+#endif
+
+//value cr3 takes for a directory
+static uint32_t vmm_dir_cr3(pagedir_t* dir){
+#ifdef CONFIG_PAE
+    return (uint32_t)(uintptr_t)VIRT_TO_PHYS(pdpt_pool[vmm_pdpt_slot(dir)]);
+#else
+    return (uint32_t)(uintptr_t)VIRT_TO_PHYS(dir);
+#endif
+}
+
+//give back the directory frames, its tables must be gone already
+static void vmm_free_pagedir(pagedir_t* dir){
+#ifdef CONFIG_PAE
+    pdpt_used[vmm_pdpt_slot(dir)] = false;
+#endif
+    kmm_frame_free_contig(VIRT_TO_PHYS(dir), VMM_DIR_FRAMES);
+}
+
 pagedir_t* vmm_create_address_space(void){
-    //allocate physical frame for directory
-    void* frame_phys = kmm_frame_alloc();
+    //allocate zeroed physical frames for directory
+#ifdef CONFIG_PAE
+    void* frame_phys = kmm_frame_alloc_contig(VMM_DIR_FRAMES, VMM_DIR_FRAMES);
+    if(!frame_phys){
+        return NULL;
+    }
+    memset(PHYS_TO_VIRT(frame_phys), 0, sizeof(pagedir_t));
+    if(!vmm_pdpt_attach(frame_phys)){
+        kmm_frame_free_contig(frame_phys, VMM_DIR_FRAMES);
+        return NULL;
+    }
+#else
+    void* frame_phys = kmm_frame_alloc_zeroed();
     if(!frame_phys){
         return NULL;
     }
+#endif
     
-    //access via physmap and initialize
+    //access via physmap
     pagedir_t* dir = (pagedir_t*)PHYS_TO_VIRT(frame_phys);
-    memset(dir, 0, sizeof(pagedir_t));
+    kmm_frame_set_private(frame_phys, 0);  //no vma space bound yet
+    
+    //kernel half comes from the template, its tables are shared by everyone
+    if(kernel_directory){
+        memcpy(&dir->table[KERNEL_PDE_START], &kernel_directory->table[KERNEL_PDE_START], (VMM_PAGES_PER_DIR - KERNEL_PDE_START) * sizeof(pde_t));
+    }
     return dir;
 }
 
@@ -50,7 +311,7 @@ bool vmm_switch_pagedir(pagedir_t* new_pagedir){
     current_directory = new_pagedir;
     
     //load physical address into CR3
-    uint32_t dir_phys = (uint32_t)(uintptr_t)VIRT_TO_PHYS(new_pagedir);
+    uint32_t dir_phys = vmm_dir_cr3(new_pagedir);
     asm volatile("mov %0, %%cr3" :: "r"(dir_phys) : "memory");
     return true;
 }
@@ -63,15 +324,13 @@ void vmm_create_pt(pagedir_t* pdir, void* virtual, uint32_t flags){
         return;
     }
     
-    //allocate
-    void* table_phys = kmm_frame_alloc();
+    //allocate, comes back zeroed
+    void* table_phys = kmm_frame_alloc_zeroed();
     if(!table_phys){
         return;
     }
     
-    //initialize via physmap
-    pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT(table_phys);
-    memset(table, 0, sizeof(pagetable_t));
+    kmm_frame_set_private(table_phys, 0);  //no present ptes yet
     
     //set up pde
     uint32_t pde_flags = PDE_PRESENT;
@@ -80,7 +339,67 @@ void vmm_create_pt(pagedir_t* pdir, void* virtual, uint32_t flags){
     pdir->table[pd_index] = pde_create(table_phys, pde_flags);
 }
 
-void vmm_map_page(pagedir_t* pdir, void* virtual, void* physical, uint32_t flags){
+//present ptes of a page table, counted in its frame descriptor
+static inline void pt_count_adjust(uint32_t table_phys, int32_t delta){
+    void* frame = (void*)(uintptr_t)table_phys;
+    kmm_frame_set_private(frame, kmm_frame_get_private(frame) + delta);
+}
+
+//turn a user large page into a table of small ones over the same frames
+//every frame already carries its own reference, so they can go one by one
+static bool vmm_split_large(pagedir_t* pdir, uint32_t pd_index){
+    pde_t large_entry = pdir->table[pd_index];
+    if(!PDE_IS_PRESENT(large_entry) || !PDE_IS_LARGE(large_entry)){
+        return true;
+    }
+    void* table_phys = kmm_frame_alloc();
+    if(!table_phys){
+        return false;
+    }
+    pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT(table_phys);
+    uint32_t first_pfn = (uint32_t)((large_entry & PDE_LARGE_FRAME_MASK) / VMM_PAGE_SIZE);
+    uint32_t entry_flags = pte_flags(large_entry) & ~PDE_LARGE;  //bit 7 is pat in a pte
+    for(uint32_t i = 0; i < VMM_PAGES_PER_TABLE; i++){
+        table->table[i] = pte_create_pfn(first_pfn + i, entry_flags);
+    }
+    kmm_frame_set_private(table_phys, VMM_PAGES_PER_TABLE);
+    
+    pdir->table[pd_index] = pde_create(table_phys, (uint32_t)(large_entry & (PDE_PRESENT | PDE_WRITABLE | PDE_USER)));
+    uintptr_t virt_addr = pd_index * VMM_LARGE_PAGE_SIZE;
+    if(pdir == current_directory){
+        asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");  //drops the whole large translation
+    }
+    huge_splits++;
+    return true;
+}
+
+//table covering virt_addr, made first if create is set, user large pages
+//are split so the caller can work on single pages
+//NULL when there is none or a kernel large page covers the address
+static pagetable_t* vmm_walk_table(pagedir_t* pdir, uintptr_t virt_addr, bool create, uint32_t flags, uint32_t* table_phys){
+    if(create){
+        vmm_create_pt(pdir, (void*)virt_addr, flags);
+    }
+    uint32_t pd_index = VMM_DIR_INDEX(virt_addr);
+    if(pd_index < KERNEL_PDE_START && !vmm_split_large(pdir, pd_index)){
+        return NULL;
+    }
+    pde_t directory_entry = pdir->table[pd_index];
+    if(!PDE_IS_PRESENT(directory_entry) || PDE_IS_LARGE(directory_entry)){
+        return NULL;
+    }
+    *table_phys = (uint32_t)PDE_PTABLE_ADDR(directory_entry);
+    return pde_table(directory_entry);
+}
+
+//end of the part of [virt_addr, range_end) one page table covers
+static inline uintptr_t vmm_table_span_end(uintptr_t virt_addr, uintptr_t range_end){
+    uintptr_t table_end = (virt_addr & ~(VMM_LARGE_PAGE_SIZE - 1)) + VMM_LARGE_PAGE_SIZE;
+    return (table_end == 0 || table_end > range_end) ? range_end : table_end;
+}
+
+//map one frame by number, frames above 4GB have no physical pointer
+void vmm_map_pfn(pagedir_t* pdir, void* virtual, uint32_t pfn, uint32_t flags){
     if(!pdir || !virtual){
         return;
     }
@@ -92,65 +411,371 @@ void vmm_map_page(pagedir_t* pdir, void* virtual, void* physical, uint32_t flags
     uint32_t pt_index = VMM_TABLE_INDEX(virtual);
     
     pde_t directory_entry = pdir->table[pd_index];
-    uint32_t table_phys = PDE_PTABLE_ADDR(directory_entry);
-    pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT((void*)table_phys);
+    if(!PDE_IS_PRESENT(directory_entry) || PDE_IS_LARGE(directory_entry)){
+        return;  //no table, or already covered by a 4MB page
+    }
+    uint32_t table_phys = (uint32_t)PDE_PTABLE_ADDR(directory_entry);
+    pagetable_t* table = pde_table(directory_entry);
     
     //create and set pte
-    pte_t table_entry = pte_create(physical, flags | PTE_PRESENT);
+    if(!PTE_IS_PRESENT(table->table[pt_index])){
+        pt_count_adjust(table_phys, 1);
+    }
+    pte_t table_entry = pte_create_pfn(pfn, flags | PTE_PRESENT | vmm_global_flag((uintptr_t)virtual));
     table->table[pt_index] = table_entry;
 }
 
-void* vmm_get_phys_frame(pagedir_t* pdir, void* virtual){
+void vmm_map_page(pagedir_t* pdir, void* virtual, void* physical, uint32_t flags){
+    vmm_map_pfn(pdir, virtual, (uintptr_t)physical / VMM_PAGE_SIZE, flags);
+}
+
+//frame number backing virtual, 0 if nothing is mapped there
+uint32_t vmm_get_pfn(pagedir_t* pdir, void* virtual){
     if(!pdir || !virtual){
-        return NULL;
+        return 0;
     }
     uint32_t pd_index = VMM_DIR_INDEX(virtual);
     uint32_t pt_index = VMM_TABLE_INDEX(virtual);
     pde_t directory_entry = pdir->table[pd_index];
     if(!PDE_IS_PRESENT(directory_entry)){
-        return NULL;
+        return 0;
+    }
+    if(PDE_IS_LARGE(directory_entry)){
+        uintptr_t offset = (uintptr_t)virtual & (VMM_LARGE_PAGE_SIZE - 1);
+        return (uint32_t)((directory_entry & PDE_LARGE_FRAME_MASK) / VMM_PAGE_SIZE) + offset / VMM_PAGE_SIZE;
     }
     
-    uint32_t table_phys = PDE_PTABLE_ADDR(directory_entry);
-    pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT((void*)table_phys);
+    pagetable_t* table = pde_table(directory_entry);
     pte_t table_entry = table->table[pt_index];
     
     if(!PTE_IS_PRESENT(table_entry)){
+        return 0;
+    }
+    
+    return pte_pfn(table_entry);
+}
+
+//physical frame for lowmem callers, anything above 4GB needs vmm_get_pfn
+void* vmm_get_phys_frame(pagedir_t* pdir, void* virtual){
+    uint32_t pfn = vmm_get_pfn(pdir, virtual);
+    if(pfn == 0 || pfn >= 0x100000){
+        return NULL;
+    }
+    return (void*)(pfn * VMM_PAGE_SIZE);
+}
+
+//back the whole aligned large page at virtual with one pde, for anonymous
+//user memory that is not mapped at all yet
+//false when the cpu has no large pages, the slot is taken or memory is too
+//fragmented, the caller then falls back to small pages
+bool vmm_alloc_large(pagedir_t* pdir, void* virtual, uint32_t flags){
+    uintptr_t virt_addr = (uintptr_t)virtual;
+    uint32_t pd_index = VMM_DIR_INDEX(virt_addr);
+    if(!pdir || !pse_enabled || (virt_addr & (VMM_LARGE_PAGE_SIZE - 1)) || pd_index >= KERNEL_PDE_START || PDE_IS_PRESENT(pdir->table[pd_index])){
+        return false;
+    }
+    void* frames = kmm_frame_alloc_contig(VMM_PAGES_PER_TABLE, VMM_PAGES_PER_TABLE);
+    if(!frames){
+        huge_fallbacks++;
+        return false;
+    }
+    memset(PHYS_TO_VIRT(frames), 0, VMM_LARGE_PAGE_SIZE);
+    pdir->table[pd_index] = ((uintptr_t)frames & PDE_LARGE_FRAME_MASK) | pte_encode_flags(flags | PDE_LARGE | PDE_PRESENT);
+    huge_hits++;
+    return true;
+}
+
+//split the large page covering virtual, for callers about to change part of it
+bool vmm_split_large_page(pagedir_t* pdir, void* virtual){
+    uint32_t pd_index = VMM_DIR_INDEX(virtual);
+    if(!pdir || pd_index >= KERNEL_PDE_START){
+        return false;
+    }
+    return vmm_split_large(pdir, pd_index);
+}
+
+uint32_t vmm_get_huge_hits(void){
+    return huge_hits;
+}
+
+uint32_t vmm_get_huge_fallbacks(void){
+    return huge_fallbacks;
+}
+
+uint32_t vmm_get_huge_splits(void){
+    return huge_splits;
+}
+
+//read of an untouched anonymous page, share the zero frame until it is written
+//the frame is reserved, so references taken or dropped on it are no-ops
+bool vmm_map_zero_page(pagedir_t* pdir, void* virtual, uint32_t flags){
+    if(!pdir || zero_pfn == 0){
+        return false;
+    }
+    vmm_map_pfn(pdir, virtual, zero_pfn, zero_page_flags(flags));
+    if(vmm_get_pfn(pdir, virtual) != zero_pfn){
+        return false;
+    }
+    zero_page_maps++;
+    return true;
+}
+
+uint32_t vmm_get_zero_page_maps(void){
+    return zero_page_maps;
+}
+
+//temporary kernel mapping of any frame, undone with vmm_kunmap
+//NULL when every window slot is taken
+void* vmm_kmap(uint32_t pfn){
+    if(!kernel_directory || pfn == 0){
+        return NULL;
+    }
+    uint32_t eflags = irq_save();
+    uint32_t slot = KMAP_PAGES;
+    for(uint32_t i = 0; i < KMAP_PAGES; i++){
+        if(!(kmap_used[i / 32] & (1u << (i % 32)))){
+            kmap_used[i / 32] |= 1u << (i % 32);
+            slot = i;
+            break;
+        }
+    }
+    irq_restore(eflags);
+    if(slot == KMAP_PAGES){
         return NULL;
     }
     
-    return (void*)(uintptr_t)PTE_FRAME_ADDR(table_entry);
+    //the template table is shared, so the window works from any directory
+    uintptr_t virt_addr = KMAP_START + slot * VMM_PAGE_SIZE;
+    pte_t* entry = &pde_table(kernel_directory->table[VMM_DIR_INDEX(virt_addr)])->table[VMM_TABLE_INDEX(virt_addr)];
+    *entry = pte_create_pfn(pfn, PTE_PRESENT | PTE_WRITABLE | PTE_NOEXEC | vmm_global_flag(virt_addr));
+    asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+    return (void*)virt_addr;
+}
+
+void vmm_kunmap(void* virtual){
+    uintptr_t virt_addr = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
+    if(virt_addr < KMAP_START || virt_addr >= KMAP_START + KMAP_PAGES * VMM_PAGE_SIZE){
+        return;
+    }
+    uint32_t slot = (virt_addr - KMAP_START) / VMM_PAGE_SIZE;
+    pde_table(kernel_directory->table[VMM_DIR_INDEX(virt_addr)])->table[VMM_TABLE_INDEX(virt_addr)] = 0;
+    asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+    __atomic_and_fetch(&kmap_used[slot / 32], ~(1u << (slot % 32)), __ATOMIC_RELEASE);
+}
+
+//copy one frame to another through the kmap window
+static bool vmm_copy_pfn(uint32_t dst_pfn, uint32_t src_pfn){
+    void* dst = vmm_kmap(dst_pfn);
+    void* src = vmm_kmap(src_pfn);
+    if(dst && src){
+        memcpy(dst, src, VMM_PAGE_SIZE);
+    }
+    vmm_kunmap(src);
+    vmm_kunmap(dst);
+    return dst && src;
+}
+
+bool vmm_nx_enabled(void){
+    return nx_enabled;
+}
+
+//pte for a virtual address, NULL if its page table is missing
+static pte_t* vmm_lookup_pte(pagedir_t* pdir, uintptr_t virt_addr){
+    pde_t directory_entry = pdir->table[VMM_DIR_INDEX(virt_addr)];
+    if(!PDE_IS_PRESENT(directory_entry) || PDE_IS_LARGE(directory_entry)){
+        return NULL;
+    }
+    return &pde_table(directory_entry)->table[VMM_TABLE_INDEX(virt_addr)];
+}
+
+//write to a copy-on-write page, give the writer its own frame
+static bool vmm_resolve_cow(pagedir_t* pdir, uintptr_t fault_address){
+    pte_t* entry = vmm_lookup_pte(pdir, fault_address);
+    if(!entry || !PTE_IS_PRESENT(*entry) || !(*entry & PTE_COW)){
+        return false;
+    }
+    //the mark outlives mprotect, the range decides whether writes are allowed
+    if(!vma_writable(pdir, fault_address)){
+        return false;
+    }
+    uint32_t old_pfn = pte_pfn(*entry);
+    uint32_t entry_flags = (pte_flags(*entry) & ~PTE_COW) | PTE_WRITABLE;
+    
+    //last sharer keeps the frame, the zero frame counts none and is always copied
+    if(kmm_pfn_refcount(old_pfn) == 1){
+        *entry = pte_create_pfn(old_pfn, entry_flags);
+    }
+    else{
+        //the copy belongs to one process only, highmem is fine
+        uint32_t new_pfn = kmm_highmem_alloc();
+        if(new_pfn == 0){
+            return false;
+        }
+        if(!vmm_copy_pfn(new_pfn, old_pfn)){
+            kmm_pfn_put(new_pfn);
+            return false;
+        }
+        if(new_pfn < kmm_get_lowmem_frames()){
+            kmm_frame_mark_movable((void*)(new_pfn * VMM_PAGE_SIZE));
+        }
+        *entry = pte_create_pfn(new_pfn, entry_flags);
+        kmm_pfn_put(old_pfn);
+    }
+    uintptr_t page = fault_address & ~(VMM_PAGE_SIZE - 1);
+    asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+    return true;
 }
 
 void _vmm_page_fault_handler(interrupt_context_t* ctx){
     uintptr_t fault_address;
     asm volatile("mov %%cr2, %0" : "=r"(fault_address));
+    
+    if((ctx->err_code & PF_PRESENT) && (ctx->err_code & PF_WRITE)){
+        if(vmm_resolve_cow(current_directory, fault_address)){
+            return;
+        }
+    }
+    if(!(ctx->err_code & PF_PRESENT)){
+        if(vma_handle_fault(current_directory, fault_address, (ctx->err_code & PF_USER) != 0, (ctx->err_code & PF_WRITE) != 0)){
+            return;
+        }
+    }
     for(;;){
         asm volatile("hlt");
     }
 }
 
+#ifdef CONFIG_PAE
+//pae can only be turned on with paging off, so the switch runs from an
+//identity mapped copy of this stub, the stack is not touched in between
+extern char vmm_pae_switch_start[];
+extern char vmm_pae_switch_end[];
+asm(".text\n"
+    "vmm_pae_switch_start:\n"
+    "    mov 4(%esp), %eax\n"           //pdpt
+    "    mov %cr0, %ecx\n"
+    "    and $0x7FFFFFFF, %ecx\n"
+    "    mov %ecx, %cr0\n"
+    "    mov %cr4, %edx\n"
+    "    or $0x20, %edx\n"              //cr4.pae
+    "    mov %edx, %cr4\n"
+    "    mov %eax, %cr3\n"
+    "    or $0x80000000, %ecx\n"        //cr0.pg
+    "    mov %ecx, %cr0\n"
+    "    ret\n"
+    "vmm_pae_switch_end:\n");
+
+//leave the boot tables for dir, both identity map the low 1MB
+static void vmm_enable_pae(pagedir_t* dir){
+    memcpy(PHYS_TO_VIRT((void*)PAE_TRAMPOLINE_PHYS), vmm_pae_switch_start, vmm_pae_switch_end - vmm_pae_switch_start);
+    uint32_t eflags = irq_save();
+    current_directory = dir;
+    ((void (*)(uint32_t))PAE_TRAMPOLINE_PHYS)(vmm_dir_cr3(dir));
+    irq_restore(eflags);
+}
+#endif
+
+//physmap pages holding none of the kernel image are data only
+static uint32_t vmm_physmap_noexec(uintptr_t pa, uintptr_t size){
+    uintptr_t image_start = (uintptr_t)VIRT_TO_PHYS(&kernel_start);
+    uintptr_t image_end = (uintptr_t)VIRT_TO_PHYS(&kernel_end);
+    return (pa + size <= image_start || pa >= image_end) ? PTE_NOEXEC : 0;
+}
+
 void vmm_init(void){
+    uint64_t begin = rdtsc();
     register_interrupt_handler(14, _vmm_page_fault_handler);
+    pge_enabled = cpu_has_feature(CPUID_EDX_PGE);
+#ifdef CONFIG_PAE
+    //before any table carries the nx bit, it is reserved while nxe is clear
+    nx_enabled = cpu_has_nx();
+    if(nx_enabled){
+        uint32_t low, high;
+        asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(MSR_EFER));
+        asm volatile("wrmsr" :: "a"(low | EFER_NXE), "d"(high), "c"(MSR_EFER));
+    }
+#endif
     
     kernel_directory = vmm_create_address_space();
     if(!kernel_directory){
         for (;;) asm volatile("hlt");
     }
     
-    //low 1MB
+    //low 1MB, kept on 4KB pages: its pde also covers the start of user space
     for(uintptr_t va = IDENTITY_MAP_START; va < IDENTITY_MAP_END; va += VMM_PAGE_SIZE){
         vmm_map_page(kernel_directory, (void*)va, (void*)va, PTE_PRESENT | PTE_WRITABLE);
     }
     
-    //phys mem to high virt addr
-    uint32_t physical_memory = kmm_get_total_frames() * VMM_PAGE_SIZE;
-    for(uintptr_t pa = 0; pa < physical_memory; pa += VMM_PAGE_SIZE){
+    //lowmem to high virt addr, large pages where the cpu has them
+    //highmem has no permanent mapping, the kernel reaches it through kmap
+    uintptr_t physical_memory = kmm_get_lowmem_frames() * VMM_PAGE_SIZE;
+    uintptr_t pa = 0;
+#ifdef CONFIG_PAE
+    pse_enabled = true;  //2MB pdes come with pae
+#else
+    pse_enabled = cpu_has_feature(CPUID_EDX_PSE);
+    if(pse_enabled){
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PSE) : "memory");
+    }
+#endif
+    if(pse_enabled){
+        for(; pa + VMM_LARGE_PAGE_SIZE <= physical_memory; pa += VMM_LARGE_PAGE_SIZE){
+            uintptr_t va = (uintptr_t)PHYS_TO_VIRT(pa);
+            uint32_t pde_flags = PDE_LARGE | PDE_PRESENT | PDE_WRITABLE | vmm_global_flag(va) | vmm_physmap_noexec(pa, VMM_LARGE_PAGE_SIZE);
+            kernel_directory->table[VMM_DIR_INDEX(va)] = ((pde_t)pa & PDE_LARGE_FRAME_MASK) | pte_encode_flags(pde_flags);
+        }
+    }
+    //remainder (or everything without pse) on 4KB pages
+    for(; pa < physical_memory; pa += VMM_PAGE_SIZE){
         uintptr_t va = (uintptr_t)PHYS_TO_VIRT(pa);
-        vmm_map_page(kernel_directory, (void*)va, (void*)pa, PTE_PRESENT | PTE_WRITABLE);
+        vmm_map_page(kernel_directory, (void*)va, (void*)pa, PTE_PRESENT | PTE_WRITABLE | vmm_physmap_noexec(pa, VMM_PAGE_SIZE));
     }
     
+    void* zero_frame = kmm_frame_alloc_zeroed();
+    if(!zero_frame){
+        for (;;) asm volatile("hlt");
+    }
+    kmm_frame_reserve(zero_frame);
+    zero_pfn = (uintptr_t)zero_frame / VMM_PAGE_SIZE;
+    
+    //tables for the rest of the kernel half, never freed so that directories
+    //copied from this template keep seeing the same kernel mappings
+    //pde is user-accessible, the ptes decide
+    for(uint32_t pd_idx = KERNEL_PDE_START; pd_idx < VMM_PAGES_PER_DIR; pd_idx++){
+        if(PDE_IS_PRESENT(kernel_directory->table[pd_idx])){
+            continue;
+        }
+        vmm_create_pt(kernel_directory, (void*)(pd_idx * VMM_LARGE_PAGE_SIZE), PTE_WRITABLE | PTE_USER);
+        if(!PDE_IS_PRESENT(kernel_directory->table[pd_idx])){
+            for (;;) asm volatile("hlt");
+        }
+    }
+    
+#ifdef CONFIG_PAE
+    vmm_enable_pae(kernel_directory);
+#else
     vmm_switch_pagedir(kernel_directory);
+#endif
+    
+    //global pages only once paging is up, cr3 loads then keep kernel translations
+    if(pge_enabled){
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PGE) : "memory");
+    }
+    
+    //kernel writes into user memory must fault on copy-on-write pages too
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+    init_cycles = rdtsc() - begin;
+}
+
+//tsc cycles vmm_init took, mostly building the physmap
+uint64_t vmm_get_init_cycles(void){
+    return init_cycles;
 }
 
 int32_t vmm_page_alloc(pte_t* pte, uint32_t flags){
@@ -176,8 +801,7 @@ void vmm_page_free(pte_t* pte){
     }
     
     //free phys frame
-    void* frame = (void*)(uintptr_t)PTE_FRAME_ADDR(*pte);
-    kmm_frame_free(frame);
+    kmm_pfn_put(pte_pfn(*pte));
     *pte &= ~PTE_FRAME_MASK;
     PTE_UNSET_PRESENT(*pte);
 }
@@ -186,122 +810,336 @@ bool vmm_alloc_region(pagedir_t* pdir, void* virtual, size_t size, uint32_t flag
     if(!pdir || !virtual || size == 0){
         return false;
     }
-    uintptr_t region_start = (uintptr_t)virtual;
-    uintptr_t region_end = region_start + size;
+    uintptr_t region_start = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t region_end = ((uintptr_t)virtual + size + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t virt_addr = region_start;
     
-    for(uintptr_t virt_addr = region_start; virt_addr < region_end; virt_addr += VMM_PAGE_SIZE){
-        vmm_create_pt(pdir, (void*)virt_addr, flags);
-        uint32_t pd_index = VMM_DIR_INDEX(virt_addr);
-        if (!PDE_IS_PRESENT(pdir->table[pd_index])) {
-            vmm_free_region(pdir, virtual, virt_addr - region_start);
+    while(virt_addr < region_end){
+        uintptr_t span_end = vmm_table_span_end(virt_addr, region_end);
+        uint32_t table_phys;
+        pagetable_t* table = vmm_walk_table(pdir, virt_addr, true, flags, &table_phys);
+        if(!table){
+            vmm_free_region(pdir, (void*)region_start, virt_addr - region_start);
             return false;
         }
-        uint32_t table_phys = PDE_PTABLE_ADDR(pdir->table[pd_index]);
-        pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT((void*)table_phys);
-        uint32_t pt_index = VMM_TABLE_INDEX(virt_addr);
-        pte_t* entry = &table->table[pt_index];
         
-        //allocate frame
-        if(vmm_page_alloc(entry, flags) != 0){
-            vmm_free_region(pdir, virtual, virt_addr - region_start);
+        uint32_t added = 0;
+        for(; virt_addr < span_end; virt_addr += VMM_PAGE_SIZE){
+            pte_t* entry = &table->table[VMM_TABLE_INDEX(virt_addr)];
+            if(PTE_IS_PRESENT(*entry)){
+                continue;
+            }
+            //allocate frame
+            if(vmm_page_alloc(entry, flags | vmm_global_flag(virt_addr)) != 0){
+                break;
+            }
+            added++;
+            
+            //user data in a process can be moved around by compaction
+            if((flags & PTE_USER) && pdir != kernel_directory){
+                kmm_frame_mark_movable((void*)(uintptr_t)PTE_FRAME_ADDR(*entry));
+            }
+        }
+        pt_count_adjust(table_phys, added);
+        if(virt_addr < span_end){
+            vmm_free_region(pdir, (void*)region_start, virt_addr - region_start);
             return false;
         }
     }
     return true;
 }
 
+//clear the present ptes in [region_start, region_end) table by table, dropping
+//the frame references too if release is set, tables left empty are freed
+static void vmm_unmap_walk(pagedir_t* pdir, uintptr_t region_start, uintptr_t region_end, bool release){
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pdir);
+    uintptr_t virt_addr = region_start;
+    
+    while(virt_addr < region_end){
+        uintptr_t span_end = vmm_table_span_end(virt_addr, region_end);
+        //a user large page going away as a whole is dropped without a split
+        pde_t dir_entry = pdir->table[VMM_DIR_INDEX(virt_addr)];
+        if(PDE_IS_PRESENT(dir_entry) && PDE_IS_LARGE(dir_entry) && VMM_DIR_INDEX(virt_addr) < KERNEL_PDE_START && span_end - virt_addr == VMM_LARGE_PAGE_SIZE){
+            pdir->table[VMM_DIR_INDEX(virt_addr)] = 0;
+            tlb_batch_add(&batch, virt_addr, dir_entry);
+            if(release){
+                uint32_t first_pfn = (uint32_t)((dir_entry & PDE_LARGE_FRAME_MASK) / VMM_PAGE_SIZE);
+                for(uint32_t i = 0; i < VMM_PAGES_PER_TABLE; i++){
+                    kmm_pfn_put(first_pfn + i);
+                }
+            }
+            virt_addr = span_end;
+            continue;
+        }
+        uint32_t table_phys;
+        pagetable_t* table = vmm_walk_table(pdir, virt_addr, false, 0, &table_phys);
+        if(!table){
+            virt_addr = span_end;
+            continue;
+        }
+        
+        uint32_t removed = 0;
+        for(; virt_addr < span_end; virt_addr += VMM_PAGE_SIZE){
+            pte_t* entry = &table->table[VMM_TABLE_INDEX(virt_addr)];
+            pte_t old_entry = *entry;
+            if(!PTE_IS_PRESENT(old_entry)){
+                continue;
+            }
+            if(release){
+                vmm_page_free(entry);
+            }
+            else{
+                *entry = 0;
+            }
+            tlb_batch_add(&batch, virt_addr, old_entry);
+            removed++;
+        }
+        pt_count_adjust(table_phys, -(int32_t)removed);
+        
+        //free empty pt, kernel half tables belong to the template
+        uint32_t pd_index = VMM_DIR_INDEX(span_end - 1);
+        if(pd_index < KERNEL_PDE_START && kmm_frame_get_private((void*)(uintptr_t)table_phys) == 0){
+            pdir->table[pd_index] = 0;
+            tlb_batch_flush(&batch);  //nothing may walk through it any more
+            kmm_frame_free((void*)(uintptr_t)table_phys);
+        }
+    }
+    tlb_batch_flush(&batch);
+}
+
 bool vmm_free_region(pagedir_t* pdir, void* virtual, size_t size){
     if(!pdir || !virtual || size == 0){
         return false;
     }
     uintptr_t region_start = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
     uintptr_t region_end = ((uintptr_t)virtual + size + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
+    vmm_unmap_walk(pdir, region_start, region_end, true);
+    return true;
+}
+
+//map [virtual, virtual + size) onto contiguous physical memory, the caller
+//keeps ownership of the frames
+bool vmm_map_range(pagedir_t* pdir, void* virtual, void* physical, size_t size, uint32_t flags){
+    if(!pdir || !virtual || size == 0){
+        return false;
+    }
+    uintptr_t virt_addr = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t region_end = ((uintptr_t)virtual + size + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t phys_addr = (uintptr_t)physical & ~(VMM_PAGE_SIZE - 1);
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pdir);
     
-    for(uintptr_t virt_addr = region_start; virt_addr < region_end; virt_addr += VMM_PAGE_SIZE){
-        uint32_t pd_index = VMM_DIR_INDEX(virt_addr);
-        if(!PDE_IS_PRESENT(pdir->table[pd_index])){
-            continue;
+    while(virt_addr < region_end){
+        uintptr_t span_end = vmm_table_span_end(virt_addr, region_end);
+        uint32_t table_phys;
+        pagetable_t* table = vmm_walk_table(pdir, virt_addr, true, flags, &table_phys);
+        if(!table){
+            tlb_batch_flush(&batch);
+            return false;
         }
-        uint32_t table_phys = PDE_PTABLE_ADDR(pdir->table[pd_index]);
-        pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT((void*)table_phys);
-        uint32_t pt_index = VMM_TABLE_INDEX(virt_addr);
         
-        if(PTE_IS_PRESENT(table->table[pt_index])){
-            vmm_page_free(&table->table[pt_index]);
+        uint32_t added = 0;
+        for(; virt_addr < span_end; virt_addr += VMM_PAGE_SIZE, phys_addr += VMM_PAGE_SIZE){
+            pte_t* entry = &table->table[VMM_TABLE_INDEX(virt_addr)];
+            if(PTE_IS_PRESENT(*entry)){
+                tlb_batch_add(&batch, virt_addr, *entry);
+            }
+            else{
+                added++;
+            }
+            *entry = pte_create((void*)phys_addr, flags | PTE_PRESENT | vmm_global_flag(virt_addr));
         }
-        //invalid
-        asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+        pt_count_adjust(table_phys, added);
     }
+    tlb_batch_flush(&batch);
+    return true;
+}
+
+//undo vmm_map_range, frames are left to their owner
+bool vmm_unmap_range(pagedir_t* pdir, void* virtual, size_t size){
+    if(!pdir || !virtual || size == 0){
+        return false;
+    }
+    uintptr_t region_start = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t region_end = ((uintptr_t)virtual + size + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
+    vmm_unmap_walk(pdir, region_start, region_end, false);
+    return true;
+}
+
+//new flags for every present page in the range, copy-on-write pages keep
+//their mark and stay read-only until written, whatever the new flags
+bool vmm_protect_range(pagedir_t* pdir, void* virtual, size_t size, uint32_t flags){
+    if(!pdir || !virtual || size == 0){
+        return false;
+    }
+    uintptr_t virt_addr = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t region_end = ((uintptr_t)virtual + size + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pdir);
     
-    //check for empty pt and free
-    uint32_t start_pd = VMM_DIR_INDEX(region_start);
-    uint32_t end_pd = VMM_DIR_INDEX(region_end - 1);
-    
-    for(uint32_t pd_idx = start_pd; pd_idx <= end_pd; pd_idx++){
-        if(!PDE_IS_PRESENT(pdir->table[pd_idx])){
+    while(virt_addr < region_end){
+        uintptr_t span_end = vmm_table_span_end(virt_addr, region_end);
+        uint32_t table_phys;
+        pagetable_t* table = vmm_walk_table(pdir, virt_addr, false, 0, &table_phys);
+        if(!table){
+            virt_addr = span_end;
             continue;
         }
-        uint32_t table_phys = PDE_PTABLE_ADDR(pdir->table[pd_idx]);
-        pagetable_t* table = (pagetable_t*)PHYS_TO_VIRT((void*)table_phys);
+        //the pde must not be stricter than what its ptes ask for
+        uint32_t pd_index = VMM_DIR_INDEX(virt_addr);
+        if(pd_index < KERNEL_PDE_START){
+            if(flags & PTE_WRITABLE) pdir->table[pd_index] |= PDE_WRITABLE;
+            if(flags & PTE_USER) pdir->table[pd_index] |= PDE_USER;
+        }
         
-        //check if empty
-        bool has_entries = false;
-        for(uint32_t i = 0; i < VMM_PAGES_PER_TABLE; i++){
-            if(PTE_IS_PRESENT(table->table[i])){
-                has_entries = true;
-                break;
+        for(; virt_addr < span_end; virt_addr += VMM_PAGE_SIZE){
+            pte_t* entry = &table->table[VMM_TABLE_INDEX(virt_addr)];
+            pte_t old_entry = *entry;
+            if(!PTE_IS_PRESENT(old_entry)){
+                continue;
             }
+            uint32_t entry_flags = flags | PTE_PRESENT | vmm_global_flag(virt_addr);
+            if(pte_pfn(old_entry) == zero_pfn){
+                entry_flags = zero_page_flags(entry_flags);
+            }
+            else if(old_entry & PTE_COW){
+                entry_flags = (entry_flags & ~PTE_WRITABLE) | PTE_COW;
+            }
+            *entry = pte_create_pfn(pte_pfn(old_entry), entry_flags);
+            if(*entry != old_entry){
+                tlb_batch_add(&batch, virt_addr, old_entry);
+            }
+        }
+    }
+    tlb_batch_flush(&batch);
+    return true;
+}
+
+//whether the page was written since it was mapped or last cleaned
+bool vmm_page_dirty(pagedir_t* pdir, void* virtual){
+    if(!pdir){
+        return false;
+    }
+    pte_t* entry = vmm_lookup_pte(pdir, (uintptr_t)virtual);
+    return entry && PTE_IS_PRESENT(*entry) && (*entry & PTE_DIRTY);
+}
+
+//clear the dirty bits in the range after its pages were written back
+void vmm_clean_range(pagedir_t* pdir, void* virtual, size_t size){
+    if(!pdir || size == 0){
+        return;
+    }
+    uintptr_t virt_addr = (uintptr_t)virtual & ~(VMM_PAGE_SIZE - 1);
+    uintptr_t region_end = ((uintptr_t)virtual + size + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1);
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pdir);
+    
+    while(virt_addr < region_end){
+        uintptr_t span_end = vmm_table_span_end(virt_addr, region_end);
+        uint32_t table_phys;
+        pagetable_t* table = vmm_walk_table(pdir, virt_addr, false, 0, &table_phys);
+        if(!table){
+            virt_addr = span_end;
+            continue;
+        }
+        for(; virt_addr < span_end; virt_addr += VMM_PAGE_SIZE){
+            pte_t* entry = &table->table[VMM_TABLE_INDEX(virt_addr)];
+            if(PTE_IS_PRESENT(*entry) && (*entry & PTE_DIRTY)){
+                tlb_batch_add(&batch, virt_addr, *entry);
+                *entry &= ~PTE_DIRTY;  //the cached translation must go too or the bit is not set again
+            }
+        }
+    }
+    tlb_batch_flush(&batch);
+}
+
+//move user frames in [start_phys, end_phys) to new frames and repoint their ptes
+//shared frames are left alone, returns how many frames were moved
+uint32_t vmm_migrate_range(pagedir_t* pdir, uintptr_t start_phys, uintptr_t end_phys){
+    if(!pdir){
+        return 0;
+    }
+    uint32_t moved = 0;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pdir);
+    for(uint32_t pd_idx = 0; pd_idx < KERNEL_PDE_START; pd_idx++){
+        pde_t dir_entry = pdir->table[pd_idx];
+        if(!PDE_IS_PRESENT(dir_entry) || !(dir_entry & PDE_USER) || PDE_IS_LARGE(dir_entry)){
+            continue;
         }
+        pagetable_t* table = pde_table(dir_entry);
         
-        //free empty
-        if(!has_entries){
-            kmm_frame_free((void*)(uintptr_t)table_phys);
-            pdir->table[pd_idx] = 0;
+        for(uint32_t pt_idx = 0; pt_idx < VMM_PAGES_PER_TABLE; pt_idx++){
+            pte_t entry = table->table[pt_idx];
+            if(!PTE_IS_PRESENT(entry) || !(entry & PTE_USER)){
+                continue;
+            }
+            //compaction ranges are lowmem, which always fits a pointer
+            uint32_t old_pfn = pte_pfn(entry);
+            if(old_pfn < start_phys / VMM_PAGE_SIZE || old_pfn >= end_phys / VMM_PAGE_SIZE){
+                continue;
+            }
+            uintptr_t old_frame = old_pfn * VMM_PAGE_SIZE;
+            if(kmm_frame_refcount((void*)old_frame) != 1){
+                continue;
+            }
+            
+            void* new_frame = kmm_frame_alloc();
+            if(!new_frame){
+                tlb_batch_flush(&batch);
+                return moved;
+            }
+            memcpy(PHYS_TO_VIRT(new_frame), PHYS_TO_VIRT((void*)old_frame), VMM_PAGE_SIZE);
+            kmm_frame_mark_movable(new_frame);
+            table->table[pt_idx] = pte_create(new_frame, pte_flags(entry));
+            tlb_batch_add(&batch, pd_idx * VMM_LARGE_PAGE_SIZE + pt_idx * VMM_PAGE_SIZE, entry);
+            kmm_frame_put((void*)old_frame);
+            moved++;
         }
     }
-    return true;
+    tlb_batch_flush(&batch);
+    return moved;
+}
+
+//drop the frame references held by a cloned table and free the table itself
+static void vmm_release_pagetable(pagetable_t* table){
+    for(uint32_t i = 0; i < VMM_PAGES_PER_TABLE; i++){
+        if(PTE_IS_PRESENT(table->table[i])){
+            kmm_pfn_put(pte_pfn(table->table[i]));
+        }
+    }
+    kmm_frame_free(VIRT_TO_PHYS(table));
 }
 
+//copy-on-write clone, frames are shared and writable ones become read-only
+//in both tables until one side writes
 pagetable_t* vmm_clone_pagetable(pagetable_t* src){
     if(!src){
         return NULL;
     }
     
-    void* new_table_phys = kmm_frame_alloc();
+    void* new_table_phys = kmm_frame_alloc_zeroed();
     if(!new_table_phys){
         return NULL;
     }
     pagetable_t* new_table = (pagetable_t*)PHYS_TO_VIRT(new_table_phys);
-    memset(new_table, 0, sizeof(pagetable_t));
     
-    //deep copy each present entry
+    //share each present entry
+    uint32_t present = 0;
     for(uint32_t i = 0; i < VMM_PAGES_PER_TABLE; i++){
         pte_t source_entry = src->table[i];
         if(!PTE_IS_PRESENT(source_entry)){
             continue;
         }
-        
-        //allocate new frame for copied data
-        void* new_frame_phys = kmm_frame_alloc();
-        if(!new_frame_phys){
-            //on fail
-            for(uint32_t j = 0; j < i; j++){
-                if(PTE_IS_PRESENT(new_table->table[j])){
-                    void* frame = (void*)(uintptr_t)PTE_FRAME_ADDR(new_table->table[j]);
-                    kmm_frame_free(frame);
-                }
-            }
-            kmm_frame_free(new_table_phys);
-            return NULL;
-        }
-        
-        //copy
-        void* source_data = PHYS_TO_VIRT((void*)(uintptr_t)PTE_FRAME_ADDR(source_entry));
-        void* dest_data = PHYS_TO_VIRT(new_frame_phys);
-        memcpy(dest_data, source_data, VMM_PAGE_SIZE);
-        uint32_t entry_flags = source_entry & 0xFFF;
-        new_table->table[i] = pte_create(new_frame_phys, entry_flags);
+        present++;
+        //read-only pages too, a later mprotect must not make the shared frame writable
+        source_entry = (source_entry & ~PTE_WRITABLE) | PTE_COW;
+        src->table[i] = source_entry;
+        kmm_pfn_get(pte_pfn(source_entry));
+        new_table->table[i] = source_entry;
     }
+    kmm_frame_set_private(new_table_phys, present);
     return new_table;
 }
 
@@ -314,44 +1152,78 @@ pagedir_t* vmm_clone_pagedir(void){
     if(!new_dir){
         return NULL;
     }
-    //clone each dir entry
-    for(uint32_t i = 0; i < VMM_PAGES_PER_DIR; i++){
+    //clone each user half dir entry, the kernel half came with the template
+    for(uint32_t i = 0; i < KERNEL_PDE_START; i++){
         pde_t current_entry = current_directory->table[i];
         if(!PDE_IS_PRESENT(current_entry)){
             continue;
         }
-        if(i >= 768){
-            new_dir->table[i] = current_entry;
-            continue;
-        }
         
-        //check if kernel mapping -> shallow copy
-        pde_t kernel_entry = kernel_directory->table[i];
-        bool is_kernel_mapping = PDE_IS_PRESENT(kernel_entry) && (PDE_PTABLE_ADDR(kernel_entry) == PDE_PTABLE_ADDR(current_entry));
-        
-        if(is_kernel_mapping){ //shallow
+        //supervisor tables (the identity map) are shared as they are
+        if(!(current_entry & PDE_USER)){ //shallow
             new_dir->table[i] = current_entry;
         }
-        else{ //deep
-            uint32_t source_table_phys = PDE_PTABLE_ADDR(current_entry);
-            pagetable_t* source_table = (pagetable_t*)PHYS_TO_VIRT((void*)source_table_phys);
-            pagetable_t* cloned_table = vmm_clone_pagetable(source_table);
+        else{ //copy-on-write, large pages are split so each small page copies on its own
+            pagetable_t* cloned_table = NULL;
+            if(vmm_split_large(current_directory, i)){
+                current_entry = current_directory->table[i];
+                cloned_table = vmm_clone_pagetable(pde_table(current_entry));
+            }
             if(!cloned_table){
+                //undo the tables cloned so far, shared kernel tables stay
                 for(uint32_t j = 0; j < i; j++){
-                    if(PDE_IS_PRESENT(new_dir->table[j])){
-                        void* table_phys = (void*)(uintptr_t)PDE_PTABLE_ADDR(new_dir->table[j]);
-                        kmm_frame_free(table_phys);
+                    pde_t new_entry = new_dir->table[j];
+                    if(PDE_IS_PRESENT(new_entry) && PDE_PTABLE_ADDR(new_entry) != PDE_PTABLE_ADDR(current_directory->table[j])){
+                        vmm_release_pagetable(pde_table(new_entry));
                     }
                 }
-                kmm_frame_free(VIRT_TO_PHYS(new_dir));
+                vmm_free_pagedir(new_dir);
+                vmm_switch_pagedir(current_directory);  //parent ptes may have turned read-only
                 return NULL;
             }
             
             //new pde w same flags
-            uint32_t dir_flags = current_entry & 0xFFF;
+            uint32_t dir_flags = (uint32_t)(current_entry & 0xFFF);
             void* cloned_table_phys = VIRT_TO_PHYS(cloned_table);
             new_dir->table[i] = pde_create(cloned_table_phys, dir_flags);
         }
     }
+    
+    //reload cr3 so the parent sees its now read-only ptes
+    vmm_switch_pagedir(current_directory);
     return new_dir;
-}
\ No newline at end of file
+}
+//free everything a process directory owns: user frames, user page tables and
+//the directory itself, tables shared with the kernel directory or a parent are
+//left alone and the kernel half belongs to the template
+//returns how many frames actually went back to kmm
+uint32_t vmm_destroy_address_space(pagedir_t* pdir){
+    if(!pdir || pdir == kernel_directory || pdir == current_directory){
+        return 0;
+    }
+    uint32_t reclaimed = 0;
+    for(uint32_t pd_idx = 0; pd_idx < KERNEL_PDE_START; pd_idx++){
+        pde_t dir_entry = pdir->table[pd_idx];
+        if(!PDE_IS_PRESENT(dir_entry) || !(dir_entry & PDE_USER) || dir_entry == kernel_directory->table[pd_idx]){
+            continue;
+        }
+        if(PDE_IS_LARGE(dir_entry)){
+            uint32_t first_pfn = (uint32_t)((dir_entry & PDE_LARGE_FRAME_MASK) / VMM_PAGE_SIZE);
+            for(uint32_t i = 0; i < VMM_PAGES_PER_TABLE; i++){
+                reclaimed += (kmm_pfn_refcount(first_pfn + i) == 1);
+                kmm_pfn_put(first_pfn + i);
+            }
+            continue;
+        }
+        pagetable_t* table = pde_table(dir_entry);
+        for(uint32_t pt_idx = 0; pt_idx < VMM_PAGES_PER_TABLE; pt_idx++){
+            if(PTE_IS_PRESENT(table->table[pt_idx]) && kmm_pfn_refcount(pte_pfn(table->table[pt_idx])) == 1){
+                reclaimed++;  //last user, the put below frees it
+            }
+        }
+        vmm_release_pagetable(table);
+        reclaimed++;
+    }
+    vmm_free_pagedir(pdir);
+    return reclaimed + VMM_DIR_FRAMES;
+}
@@ -1,5 +1,6 @@
 #include <proc/elf.h>
 #include <mm/kheap.h>
+#include <mm/vma.h>
 
 bool elf_check_hdr(elf_header_t* hdr){
     uint32_t* elf_magic_num = (uint32_t*)hdr->e_ident;
@@ -11,6 +12,11 @@ bool elf_check_hdr(elf_header_t* hdr){
     return true;
 }
 
+//a page two segments share gets the permissions of both
+static uint32_t elf_merge_flags(uint32_t a, uint32_t b){
+    return ((a | b) & ~PTE_NOEXEC) | (a & b & PTE_NOEXEC);
+}
+
 int32_t elf_load_seg(file_t* file, pagedir_t* dir, elf_phdr_t* phdr){
     uintptr_t vaddr_start = phdr->p_vaddr & ~(VMM_PAGE_SIZE - 1);
     size_t total_size = (phdr->p_vaddr + phdr->p_memsz) - vaddr_start;
@@ -19,7 +25,31 @@ int32_t elf_load_seg(file_t* file, pagedir_t* dir, elf_phdr_t* phdr){
     if(phdr->p_flags & ELF_PF_W){
         flags |= PTE_WRITABLE;
     }
-    if(!vmm_alloc_region(dir, (void*)vaddr_start, total_size, flags)){
+    if(!(phdr->p_flags & ELF_PF_X)){
+        flags |= PTE_NOEXEC;
+    }
+    
+    //only pages holding file data are backed now, the bss past them is
+    //faulted in later and reads the shared zero page until written
+    uintptr_t file_end = phdr->p_vaddr + phdr->p_filesz;
+    uintptr_t backed_end = (phdr->p_filesz > 0) ? ((file_end + VMM_PAGE_SIZE - 1) & ~(VMM_PAGE_SIZE - 1)) : vaddr_start;
+    size_t backed_size = backed_end - vaddr_start;
+    //writable while loading, the kernel honours read-only ptes too
+    if(backed_size > 0 && !vmm_alloc_region(dir, (void*)vaddr_start, backed_size, flags | PTE_WRITABLE)){
+        return -1;
+    }
+    
+    //-N and -n links start a segment on the page the one before ends on, that
+    //page stays in the earlier range and is only reopened for writing here
+    vm_space_t* space = vma_space_of(dir);
+    uint32_t shared_flags;
+    bool shared_first = vma_get_flags(space, vaddr_start, &shared_flags);
+    uintptr_t own_start = shared_first ? vaddr_start + VMM_PAGE_SIZE : vaddr_start;
+    uintptr_t segment_end = vaddr_start + total_size;
+    if(shared_first && backed_size > 0){
+        vmm_protect_range(dir, (void*)vaddr_start, VMM_PAGE_SIZE, shared_flags | PTE_WRITABLE);
+    }
+    if(own_start < segment_end && !vma_insert(space, own_start, segment_end - own_start, flags, VMA_ELF)){
         return -1;
     }
     
@@ -31,10 +61,16 @@ int32_t elf_load_seg(file_t* file, pagedir_t* dir, elf_phdr_t* phdr){
         }
     }
     
-    if(phdr->p_memsz > phdr->p_filesz){
-        void* bss_start = (void*)(phdr->p_vaddr + phdr->p_filesz);
-        size_t bss_size = phdr->p_memsz - phdr->p_filesz;
-        memset(bss_start, 0, bss_size);
+    //the rest of the last file page, start of the bss or padding, fresh
+    //frames are not zeroed
+    if(backed_end > file_end){
+        memset((void*)file_end, 0, backed_end - file_end);
+    }
+    if(shared_first && !vma_protect(space, vaddr_start, VMM_PAGE_SIZE, elf_merge_flags(shared_flags, flags))){
+        return -1;
+    }
+    if(backed_end > own_start && !(flags & PTE_WRITABLE)){
+        vmm_protect_range(dir, (void*)own_start, backed_end - own_start, flags);
     }
     return 0;
 }
@@ -11,14 +11,21 @@
 #include <proc/process.h>
 #include <proc/tss.h>
 #include <mm/kheap.h>
+#include <mm/slab.h>
 #include <mm/vmm.h>
+#include <mm/kmm.h>
+#include <mm/vma.h>
+#include <fs/vfs.h>
+#include <proc/syscall.h>
 #include <init/gdt.h>
 #include <mem.h>
 
-#define KSTACK_SIZE (2 * VMM_PAGE_SIZE)
+#define KSTACK_FRAMES 2
+#define KSTACK_SIZE (KSTACK_FRAMES * VMM_PAGE_SIZE)
 #define DEFAULT_TIMESLICE 10
 // #define DEFAULT_TIMESLICE 100
 #define USER_STACK_TOP 0xC0000000
+#define USER_STACK_SIZE (256 * VMM_PAGE_SIZE)  //vma only, backed as it grows
 
 static process_t *current_proc = NULL;
 static thread_t *current_thread = NULL;
@@ -28,6 +35,15 @@ static uint32_t next_tid = 1;
 static thread_t *ready_queue_head = NULL;
 static thread_t *ready_queue_tail = NULL;
 static process_t *process_list = NULL;
+static kmem_cache_t *process_cache = NULL;
+static kmem_cache_t *thread_cache = NULL;
+static thread_t *idle_thread = NULL;  //runs only when the ready queue is empty, never queued
+static thread_t *reaper_thread = NULL;  //like idle, but only while there is something to reap
+static process_t *reap_list = NULL;     //exited processes, linked through next
+static thread_t *dead_threads = NULL;   //threads that died on their own stack
+static volatile uint32_t reap_pending = 0;  //queued or half reaped entries
+static uint32_t last_reclaimed = 0;
+static uint32_t total_reclaimed = 0;
 
 static volatile uint32_t debug_tick_count = 0;
 
@@ -60,10 +76,10 @@ static void remove_thread_from_process(thread_t *thread){
     thread_t **prev = &thread->proc->thread_list;
     while(*prev){
         if(*prev == thread){
-            *prev = thread->next;
+            *prev = thread->proc_next;
             break;
         }
-        prev = &(*prev)->next;
+        prev = &(*prev)->proc_next;
     }
 }
 static void remove_from_ready_queue(thread_t *thread){
@@ -92,6 +108,154 @@ static void remove_from_ready_queue(thread_t *thread){
     thread->next = NULL;
 }
 
+//next thread to run, the reaper or idle thread if nothing else is ready
+static thread_t* pick_next_thread(void){
+    thread_t *next_thread = ready_queue_head;
+    if(!next_thread){
+        return (reap_pending && reaper_thread) ? reaper_thread : idle_thread;
+    }
+    ready_queue_head = next_thread->next;
+    if(!ready_queue_head){
+        ready_queue_tail = NULL;
+    }
+    next_thread->next = NULL;
+    return next_thread;
+}
+
+//compaction callback, moves user frames out of the window in every address space
+static uint32_t migrate_process_frames(uint32_t start_frame, uint32_t count){
+    uint32_t moved = 0;
+    uintptr_t start_phys = start_frame * VMM_PAGE_SIZE;
+    uintptr_t end_phys = (start_frame + count) * VMM_PAGE_SIZE;
+    for(process_t *proc = process_list; proc; proc = proc->next){
+        if(proc->page_dir && proc->page_dir != vmm_get_kerneldir()){
+            moved += vmm_migrate_range(proc->page_dir, start_phys, end_phys);
+        }
+    }
+    return moved;
+}
+
+//background work for otherwise idle cpu time
+static void idle_thread_main(void){
+    for(;;){
+        if(!kmm_zero_pool_refill()){
+            asm volatile("hlt");
+        }
+    }
+}
+
+//take a process and its threads off every scheduler list, interrupts must be
+//off, the threads stay on thread_list for whoever frees them
+static void process_unlink(process_t *proc){
+    remove_from_process_list(proc);
+    for(thread_t *thread = proc->thread_list; thread; thread = thread->proc_next){
+        remove_from_ready_queue(thread);
+    }
+}
+
+//queue an exited process for the reaper, lookups stop finding it right away
+//interrupts must be off
+static void reap_later(process_t *proc){
+    process_unlink(proc);
+    proc->next = reap_list;
+    reap_list = proc;
+    reap_pending++;
+}
+
+//kernel stacks are backed up front through the physmap, a fault on a missing
+//stack page has no stack to push its frame on and ends in a triple fault,
+//so nothing used as a stack may come from the lazily backed kmalloc heap
+static void* kstack_alloc(void){
+    void* phys = kmm_frame_alloc_contig(KSTACK_FRAMES, KSTACK_FRAMES);
+    return phys ? PHYS_TO_VIRT(phys) : NULL;
+}
+
+static void kstack_free(void* kstack){
+    kmm_frame_free_contig(VIRT_TO_PHYS(kstack), KSTACK_FRAMES);
+}
+
+//true while any thread of proc has not been marked terminated
+static bool process_has_live_threads(process_t *proc){
+    for(thread_t *thread = proc->thread_list; thread; thread = thread->proc_next){
+        if(thread->state != THREAD_TERMINATED){
+            return true;
+        }
+    }
+    return false;
+}
+
+//memory only, the thread must be off every list already
+static void thread_free(thread_t *thread){
+    if(thread->kstack){
+        kstack_free(thread->kstack);
+    }
+    kmem_cache_free(thread_cache, thread);
+}
+
+//everything an unlinked process owns, its threads included
+static void process_release(process_t *process){
+    thread_t *thread = process->thread_list;
+    while(thread){
+        thread_t *next = thread->proc_next;
+        thread_free(thread);
+        thread = next;
+    }
+    process->thread_list = NULL;
+    process->main_thread = NULL;
+    
+    //file ranges are written back first, they still need the directory
+    vma_space_destroy(process->vm);
+    process->vm = NULL;
+    if(process->page_dir && process->page_dir != vmm_get_kerneldir()){
+        pagedir_t *current_dir = vmm_get_current_pagedir();
+        if(current_dir == process->page_dir){
+            vmm_switch_pagedir(vmm_get_kerneldir());
+        }
+        last_reclaimed = vmm_destroy_address_space(process->page_dir);
+        total_reclaimed += last_reclaimed;
+        process->page_dir = NULL;
+    }
+    for(uint32_t fd = 0; fd < PROCESS_MAX_FILES; fd++){
+        if(process->files[fd]){
+            vfs_close(process->files[fd]);
+            process->files[fd] = NULL;
+        }
+    }
+}
+
+//frees what exited processes leave behind, only runs when nothing else is
+//ready so exits stay cheap for the scheduler and the exiting caller
+//everything it gets was unlinked with interrupts off, it only frees memory
+static void reaper_thread_main(void){
+    for(;;){
+        cli();
+        thread_t *thread = dead_threads;
+        process_t *proc = thread ? NULL : reap_list;
+        if(thread){
+            dead_threads = thread->next;
+        }
+        else if(proc){
+            reap_list = proc->next;
+        }
+        sti();
+        
+        if(thread){
+            thread_free(thread);
+        }
+        else if(proc){
+            process_release(proc);
+            kmem_cache_free(process_cache, proc);
+        }
+        else{
+            asm volatile("hlt");  //the next tick gives the cpu to idle
+            continue;
+        }
+        cli();
+        reap_pending--;
+        sti();
+    }
+}
+
 // PROCESSES
 void process_create(process_t* process, const char* name, int32_t priority){
     if(!process){
@@ -106,6 +270,7 @@ void process_create(process_t* process, const char* name, int32_t priority){
     process->priority = priority;
     process->exit_code = 0;
     process->page_dir = NULL;
+    process->vm = NULL;
     process->main_thread = NULL;
     process->thread_list = NULL;
     process->next = NULL;
@@ -119,22 +284,10 @@ void process_destroy(process_t* process){
     if(process == current_proc){
         return;
     }
-    remove_from_process_list(process);
-    
-    thread_t *thread = process->thread_list;
-    while(thread){
-        thread_t *next = thread->next;
-        thread_destroy(thread);
-        thread = next;
-    }
-    
-    if(process->page_dir && process->page_dir != vmm_get_kerneldir()){
-        pagedir_t *current_dir = vmm_get_current_pagedir();
-        if(current_dir == process->page_dir){
-            vmm_switch_pagedir(vmm_get_kerneldir());
-        }
-        process->page_dir = NULL;
-    }
+    cli();
+    process_unlink(process);
+    sti();
+    process_release(process);
     memset(process, 0, sizeof(process_t));
 }
 
@@ -142,11 +295,7 @@ int32_t process_spawn(const char* filename){
     if(!filename){
         return -1;
     }
-    heap_t *heap = get_kernel_heap();
-    if(!heap){
-        return -1;
-    }
-    process_t *proc = kmalloc(heap, sizeof(process_t));
+    process_t *proc = kmem_cache_alloc(process_cache);
     if(!proc){
         return -1;
     }
@@ -154,22 +303,32 @@ int32_t process_spawn(const char* filename){
     
     proc->page_dir = vmm_create_address_space();
     if(!proc->page_dir){
-        kfree(heap, proc);
+        process_destroy(proc);
+        kmem_cache_free(process_cache, proc);
+        return -1;
+    }
+    proc->vm = vma_space_create(proc->page_dir);
+    if(!proc->vm){
+        process_destroy(proc);
+        kmem_cache_free(process_cache, proc);
         return -1;
     }
     
     void *entry_point;
     int32_t result = elf_load(filename, proc->page_dir, &entry_point);
+    if(result == 0 && !vma_insert(proc->vm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE, PTE_WRITABLE | PTE_USER | PTE_NOEXEC, VMA_STACK)){
+        result = -1;
+    }
     if(result < 0 || !entry_point){
         process_destroy(proc);
-        kfree(heap, proc);
+        kmem_cache_free(process_cache, proc);
         return result;
     }
     
     thread_t *main_thread = thread_create(proc, entry_point, NULL);
     if(!main_thread){
         process_destroy(proc);
-        kfree(heap, proc);
+        kmem_cache_free(process_cache, proc);
         return -1;
     }
     proc->main_thread = main_thread;
@@ -185,7 +344,7 @@ int32_t process_fork(void){
     if(!heap){
         return -1;
     }
-    process_t *child = kmalloc(heap, sizeof(process_t));
+    process_t *child = kmem_cache_alloc(process_cache);
     if(!child){
         return -1;
     }
@@ -198,22 +357,33 @@ int32_t process_fork(void){
     
     child->page_dir = vmm_clone_pagedir();
     if(!child->page_dir){
-        kfree(heap, child);
+        process_destroy(child);
+        kmem_cache_free(process_cache, child);
         return -1;
     }
-    thread_t *child_thread = kmalloc(heap, sizeof(thread_t));
+    //ranges carry over, untouched pages stay unbacked in both
+    //descriptors do not, file_t has no reference count to share them by
+    if(current_proc->vm && current_proc->page_dir != vmm_get_kerneldir()){
+        child->vm = vma_space_clone(current_proc->vm, child->page_dir);
+        if(!child->vm){
+            process_destroy(child);
+            kmem_cache_free(process_cache, child);
+            return -1;
+        }
+    }
+    thread_t *child_thread = kmem_cache_alloc(thread_cache);
     if(!child_thread){
         process_destroy(child);
-        kfree(heap, child);
+        kmem_cache_free(process_cache, child);
         return -1;
     }
     memcpy(child_thread, current_thread, sizeof(thread_t));
     
-    child_thread->kstack = kmalloc(heap, KSTACK_SIZE);
+    child_thread->kstack = kstack_alloc();
     if(!child_thread->kstack){
-        kfree(heap, child_thread);
+        kmem_cache_free(thread_cache, child_thread);
         process_destroy(child);
-        kfree(heap, child);
+        kmem_cache_free(process_cache, child);
         return -1;
     }
     
@@ -229,7 +399,7 @@ int32_t process_fork(void){
     child_thread->state = THREAD_READY;
     child_thread->timeslice = DEFAULT_TIMESLICE;
     child_thread->next = NULL;
-    child_thread->next = child->thread_list;
+    child_thread->proc_next = child->thread_list;
     child->thread_list = child_thread;
     child->main_thread = child_thread;
     
@@ -253,25 +423,37 @@ void process_exit(process_t* process, int32_t status){
         return;
     }
     process->exit_code = status;
-    thread_t *thread = process->thread_list;
-    while(thread){
+    cli();
+    for(thread_t *thread = process->thread_list; thread; thread = thread->proc_next){
         thread->state = THREAD_TERMINATED;
-        thread = thread->next;
     }
     
     if(process == current_proc){
+        //siblings leave the ready queue now, the tick that retires this
+        //thread hands the whole process to the reaper
+        for(thread_t *thread = process->thread_list; thread; thread = thread->proc_next){
+            remove_from_ready_queue(thread);
+        }
         current_thread->state = THREAD_TERMINATED;
+        sti();
         asm volatile("int $0x20");
     }
     else{
-        process_destroy(process);
-        heap_t *heap = get_kernel_heap();
-        if(heap){
-            kfree(heap, process);
-        }
+        //off the ready queue now, the rest is the reaper's job
+        reap_later(process);
+        sti();
     }
 }
 
+//frames the last reaped address space gave back, and all of them so far
+uint32_t process_get_last_reclaimed(void){
+    return last_reclaimed;
+}
+
+uint32_t process_get_total_reclaimed(void){
+    return total_reclaimed;
+}
+
 thread_t* get_main_thread(process_t* process){
     if(!process){
         return NULL;
@@ -295,14 +477,14 @@ thread_t* thread_create(process_t* parent_process, void* entry, void* arg){
     if(!heap){
         return NULL;
     }
-    thread_t *thread = kmalloc(heap, sizeof(thread_t));
+    thread_t *thread = kmem_cache_alloc(thread_cache);
     if(!thread){
         return NULL;
     }
     memset(thread, 0, sizeof(thread_t));
-    thread->kstack = kmalloc(heap, KSTACK_SIZE);
+    thread->kstack = kstack_alloc();
     if(!thread->kstack){
-        kfree(heap, thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
 
@@ -340,7 +522,7 @@ thread_t* thread_create(process_t* parent_process, void* entry, void* arg){
     frame->ebp = 0;
     frame->esp = (uint32_t)&frame->ebx;
     thread->trap_frame = frame;
-    thread->next = parent_process->thread_list;
+    thread->proc_next = parent_process->thread_list;
     parent_process->thread_list = thread;
 
     if(!parent_process->main_thread){
@@ -356,20 +538,15 @@ int32_t thread_destroy(thread_t* thread){
     if(thread == current_thread){
         return -1;
     }
-    heap_t *heap = get_kernel_heap();
-    if(!heap){
-        return -1;
-    }
+    cli();
     remove_from_ready_queue(thread);
     remove_thread_from_process(thread);
     
     if(thread->proc && thread->proc->main_thread == thread){
         thread->proc->main_thread = NULL;
     }
-    if(thread->kstack){
-        kfree(heap, thread->kstack);
-    }
-    kfree(heap, thread);
+    sti();
+    thread_free(thread);
     return 0;
 }
 
@@ -383,16 +560,23 @@ void scheduler_init(void){
     if(!heap){
         return;
     }
-    process_t *init_proc = kmalloc(heap, sizeof(process_t));
+    //both are allocated and freed on every spawn, fork and exit
+    process_cache = kmem_cache_create("process_t", sizeof(process_t), 0, NULL);
+    thread_cache = kmem_cache_create("thread_t", sizeof(thread_t), 0, NULL);
+    if(!process_cache || !thread_cache){
+        return;
+    }
+    process_t *init_proc = kmem_cache_alloc(process_cache);
     if(!init_proc){
         return;
     }
     process_create(init_proc, "init", 0);
     init_proc->page_dir = vmm_get_kerneldir();
+    init_proc->vm = vma_space_of(init_proc->page_dir);
     
-    thread_t *init_thread = kmalloc(heap, sizeof(thread_t));
+    thread_t *init_thread = kmem_cache_alloc(thread_cache);
     if(!init_thread){
-        kfree(heap, init_proc);
+        kmem_cache_free(process_cache, init_proc);
         return;
     }
     memset(init_thread, 0, sizeof(thread_t));
@@ -401,10 +585,10 @@ void scheduler_init(void){
     init_thread->state = THREAD_RUNNING;
     init_thread->priority = 0;
     init_thread->timeslice = DEFAULT_TIMESLICE;
-    init_thread->kstack = kmalloc(heap, KSTACK_SIZE);
+    init_thread->kstack = kstack_alloc();
     if(!init_thread->kstack){
-        kfree(heap, init_thread);
-        kfree(heap, init_proc);
+        kmem_cache_free(thread_cache, init_thread);
+        kmem_cache_free(process_cache, init_proc);
         return;
     }
     
@@ -418,6 +602,12 @@ void scheduler_init(void){
     current_proc = init_proc;
     current_thread = init_thread;
     
+    //kernel thread in init, picked only when nothing else is ready
+    idle_thread = thread_create(init_proc, (void*)idle_thread_main, NULL);
+    reaper_thread = thread_create(init_proc, (void*)reaper_thread_main, NULL);
+    kmm_register_migrate_handler(migrate_process_frames);
+    syscall_init();
+    
     tss_update_esp0((uint32_t)init_thread->kstack_top);
 }
 
@@ -441,33 +631,42 @@ void scheduler_tick(interrupt_context_t* context){
         thread_t *dead = current_thread;
         process_t *dead_proc = dead->proc;
         
-        if(!ready_queue_head){
+        //we are still on the dead thread's stack, the reaper frees it and
+        //its process later
+        remove_thread_from_process(dead);
+        if(dead_proc && dead_proc->main_thread == dead){
+            dead_proc->main_thread = NULL;
+        }
+        dead->proc = NULL;
+        dead->next = dead_threads;
+        dead_threads = dead;
+        reap_pending++;
+        if(dead_proc && !process_has_live_threads(dead_proc)){
+            reap_later(dead_proc);
+        }
+        
+        thread_t *next_thread = pick_next_thread();
+        if(!next_thread){
             while(1){ 
                 asm volatile("hlt");
             }
         }
-        
-        thread_t *next_thread = ready_queue_head;
-        ready_queue_head = next_thread->next;
-        if(!ready_queue_head){
-            ready_queue_tail = NULL;
-        }
-        next_thread->next = NULL;
         next_thread->state = THREAD_RUNNING;
         next_thread->timeslice = DEFAULT_TIMESLICE;
-        
-        remove_thread_from_process(dead);
-        
-        if(dead_proc && !dead_proc->thread_list){
-            process_destroy(dead_proc);
-            heap_t *heap = get_kernel_heap();
-            if(heap){
-                kfree(heap, dead_proc);
-            }
-        }
         scheduler_switch(next_thread);
         return;
     }
+    //idle and the reaper give way as soon as anything else is ready
+    if(current_thread == idle_thread || current_thread == reaper_thread){
+        thread_t *next_thread = pick_next_thread();
+        if(next_thread != current_thread){
+            current_thread->state = THREAD_READY;
+            next_thread->state = THREAD_RUNNING;
+            next_thread->timeslice = DEFAULT_TIMESLICE;
+            scheduler_switch(next_thread);
+        }
+        return;
+    }
     current_thread->timeslice--;
 
     /////debugdebugdebug
@@ -489,12 +688,7 @@ void scheduler_tick(interrupt_context_t* context){
         scheduler_post(current_thread);
     }
 
-    thread_t *next_thread = ready_queue_head;
-    ready_queue_head = next_thread->next;
-    if(!ready_queue_head){
-        ready_queue_tail = NULL;
-    }
-    next_thread->next = NULL;
+    thread_t *next_thread = pick_next_thread();
     next_thread->state = THREAD_RUNNING;
     next_thread->timeslice = DEFAULT_TIMESLICE;
     
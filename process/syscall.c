@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <interrupts.h>
+#include <proc/syscall.h>
+#include <proc/process.h>
+#include <mm/vma.h>
+#include <mm/vmm.h>
+#include <fs/vfs.h>
+
+#define SYSCALL_VECTOR 0x80
+#define USER_SPACE_END 0xC0000000
+#define SYSCALL_PATH_MAX 256        //terminator included
+
+//call numbers, passed in eax as SYSCALL_BASE + number with arguments in ebx,
+//ecx, edx, esi, edi, ebp, anything outside the range goes to the handler the
+//vector had before, the tty read and write calls keep their numbers
+#define SYSCALL_BASE 0x100
+#define SYS_BRK 1
+#define SYS_MMAP 2
+#define SYS_MUNMAP 3
+#define SYS_MPROTECT 4
+#define SYS_OPEN 5
+#define SYS_CLOSE 6
+#define SYS_MSYNC 7
+#define SYSCALL_COUNT 8
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4             //only honoured with pae, every readable page is executable without nx
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+
+static interrupt_service_t next_handler = NULL;
+
+typedef int32_t (*syscall_fn)(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
+
+//user pages are always present and readable, write and execute are optional
+static uint32_t prot_to_flags(uint32_t prot){
+    uint32_t flags = PTE_USER;
+    if(prot & PROT_WRITE){
+        flags |= PTE_WRITABLE;
+    }
+    if(!(prot & PROT_EXEC)){
+        flags |= PTE_NOEXEC;
+    }
+    return flags;
+}
+
+static vm_space_t* current_space(void){
+    process_t *proc = get_current_proc();
+    return proc ? proc->vm : NULL;
+}
+
+static file_t* current_file(uint32_t fd){
+    process_t *proc = get_current_proc();
+    return (proc && fd < PROCESS_MAX_FILES) ? proc->files[fd] : NULL;
+}
+
+//copy a user string into buf, every byte must lie below USER_SPACE_END in
+//a range the process has mapped, so a bad pointer fails instead of faulting
+static bool copy_user_path(uintptr_t path, char* buf, size_t size){
+    vm_space_t *space = current_space();
+    uint32_t flags;
+    for(size_t i = 0; i < size; i++){
+        uintptr_t addr = path + i;
+        if(addr < path || addr >= USER_SPACE_END){
+            return false;
+        }
+        if((i == 0 || !(addr & (VMM_PAGE_SIZE - 1))) && (!vma_get_flags(space, addr, &flags) || !(flags & PTE_USER))){
+            return false;
+        }
+        buf[i] = *(const char*)addr;
+        if(buf[i] == '\0'){
+            return true;
+        }
+    }
+    return false;  //no terminator within size
+}
+
+//brk(addr), 0 queries, returns the break in effect
+static int32_t sys_brk(uint32_t addr, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5){
+    return (int32_t)vma_brk(current_space(), addr);
+}
+
+//mmap(hint, length, prot, flags, fd, offset), returns the address or -1
+//anonymous mappings are zero-filled, file ones come from the page cache
+static int32_t sys_mmap(uint32_t hint, uint32_t length, uint32_t prot, uint32_t flags, uint32_t fd, uint32_t offset){
+    uintptr_t addr;
+    if(flags & MAP_ANONYMOUS){
+        addr = vma_map(current_space(), hint, length, prot_to_flags(prot));
+    }
+    else{
+        file_t *file = current_file(fd);
+        if(!file || !(flags & (MAP_SHARED | MAP_PRIVATE))){
+            return -1;
+        }
+        addr = vma_map_file(current_space(), hint, length, prot_to_flags(prot), file->f_vnode, offset, (flags & MAP_SHARED) != 0);
+    }
+    return addr ? (int32_t)addr : -1;
+}
+
+static int32_t sys_munmap(uint32_t addr, uint32_t length, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5){
+    return vma_remove(current_space(), addr, length) ? 0 : -1;
+}
+
+static int32_t sys_mprotect(uint32_t addr, uint32_t length, uint32_t prot, uint32_t a3, uint32_t a4, uint32_t a5){
+    return vma_protect(current_space(), addr, length, prot_to_flags(prot)) ? 0 : -1;
+}
+
+static int32_t sys_msync(uint32_t addr, uint32_t length, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5){
+    return vma_sync(current_space(), addr, length) ? 0 : -1;
+}
+
+//open(path, flags), returns the lowest free descriptor or -1
+static int32_t sys_open(uint32_t path, uint32_t flags, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5){
+    process_t *proc = get_current_proc();
+    char kpath[SYSCALL_PATH_MAX];
+    if(!proc || !path || !copy_user_path(path, kpath, sizeof(kpath))){
+        return -1;
+    }
+    for(uint32_t fd = 0; fd < PROCESS_MAX_FILES; fd++){
+        if(proc->files[fd]){
+            continue;
+        }
+        file_t *file = vfs_open(kpath, flags);
+        if(!file){
+            return -1;
+        }
+        proc->files[fd] = file;
+        return (int32_t)fd;
+    }
+    return -1;
+}
+
+//mappings made from the descriptor stay valid after it is closed
+static int32_t sys_close(uint32_t fd, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5){
+    file_t *file = current_file(fd);
+    if(!file){
+        return -1;
+    }
+    get_current_proc()->files[fd] = NULL;
+    return vfs_close(file);
+}
+
+static const syscall_fn syscall_table[SYSCALL_COUNT] = {
+    [SYS_BRK] = sys_brk,
+    [SYS_MMAP] = sys_mmap,
+    [SYS_MUNMAP] = sys_munmap,
+    [SYS_MPROTECT] = sys_mprotect,
+    [SYS_OPEN] = sys_open,
+    [SYS_CLOSE] = sys_close,
+    [SYS_MSYNC] = sys_msync,
+};
+
+static void syscall_dispatch(interrupt_context_t* ctx){
+    uint32_t number = ctx->eax - SYSCALL_BASE;
+    if(ctx->eax < SYSCALL_BASE || number >= SYSCALL_COUNT || !syscall_table[number]){
+        if(next_handler){
+            next_handler(ctx);
+        }
+        else{
+            ctx->eax = (uint32_t)-1;
+        }
+        return;
+    }
+    ctx->eax = (uint32_t)syscall_table[number](ctx->ebx, ctx->ecx, ctx->edx, ctx->esi, ctx->edi, ctx->ebp);
+}
+
+void syscall_init(void){
+    interrupt_service_t previous = get_interrupt_handler(SYSCALL_VECTOR);
+    if(previous != syscall_dispatch){
+        next_handler = previous;
+    }
+    register_interrupt_handler(SYSCALL_VECTOR, syscall_dispatch);
+}